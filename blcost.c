@@ -1,42 +1,279 @@
 #include "postgres.h"
 
+#include <math.h>
+
+#include "access/genam.h"
+#include "catalog/pg_statistic.h"
 #include "fmgr.h"
+#include "miscadmin.h"
+#include "optimizer/clauses.h"
 #include "optimizer/cost.h"
+#include "optimizer/paths.h"
+#include "parser/parsetree.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
 #include "utils/selfuncs.h"
+#include "utils/syscache.h"
 
 #include "bloom.h"
 
+/*
+ * Fraction of NULLs in index column, they don't set any bit, and average
+ * width of its values
+ */
+static double
+columnNullFrac(PlannerInfo *root, IndexOptInfo *index, int indexcol,
+				int32 *width)
+{
+	RangeTblEntry	*rte = planner_rt_fetch(index->rel->relid, root);
+	HeapTuple		tuple;
+	double			nullfrac = 0.0;
+
+	*width = 0;
+
+	/* expression column */
+	if (index->indexkeys[indexcol] == 0 || rte->rtekind != RTE_RELATION)
+		return 0.0;
+
+	tuple = SearchSysCache3(STATRELATTINH,
+							ObjectIdGetDatum(rte->relid),
+							Int16GetDatum(index->indexkeys[indexcol]),
+							BoolGetDatum(rte->inh));
+	if (HeapTupleIsValid(tuple))
+	{
+		nullfrac = ((Form_pg_statistic) GETSTRUCT(tuple))->stanullfrac;
+		*width = ((Form_pg_statistic) GETSTRUCT(tuple))->stawidth;
+		ReleaseSysCache(tuple);
+	}
+
+	return nullfrac;
+}
+
+/*
+ * Index column compared by qual, -1 if unknown or not checked by index. nElems gets estimated
+ * number of elements for array qual or array operand and 1 otherwise,
+ * strategy gets strategy of operator.
+ */
+static int
+qualIndexColumn(IndexOptInfo *index, RestrictInfo *rinfo, bool nulls,
+				double *nElems, int *strategy)
+{
+	Node	*clause = (Node*) rinfo->clause;
+	Oid		opno;
+	List	*args;
+	int		i;
+
+	*nElems = 1.0;
+	*strategy = BLOOM_EQUAL_STRATEGY;
+
+	if (is_opclause(clause))
+	{
+		opno = ((OpExpr*) clause)->opno;
+		args = ((OpExpr*) clause)->args;
+	}
+	else if (IsA(clause, ScalarArrayOpExpr))
+	{
+		opno = ((ScalarArrayOpExpr*) clause)->opno;
+		args = ((ScalarArrayOpExpr*) clause)->args;
+		*nElems = estimate_array_length((Node*) lsecond(args));
+	}
+	else if (IsA(clause, NullTest))
+	{
+		NullTest	*ntest = (NullTest*) clause;
+
+		/* only IS NULL is checked, by null-marker bits */
+		if (!nulls || ntest->nulltesttype != IS_NULL || ntest->argisrow)
+			return -1;
+
+		for(i=0; i<index->ncolumns; i++)
+			if (match_index_to_operand((Node*) ntest->arg, i, index))
+				return i;
+
+		return -1;
+	}
+	else
+		return -1;
+
+	if (list_length(args) != 2)
+		return -1;
+
+	for(i=0; i<index->ncolumns; i++)
+	{
+		Node	*operand;
+
+		if (match_index_to_operand((Node*) linitial(args), i, index))
+			operand = (Node*) lsecond(args);
+		else if (match_index_to_operand((Node*) lsecond(args), i, index))
+		{
+			operand = (Node*) linitial(args);
+			opno = get_commutator(opno);
+		}
+		else
+			continue;
+
+		if (!OidIsValid(get_element_type(index->opcintype[i])))
+			return i;
+
+		/* scan ignores array keys of array column */
+		if (!is_opclause(clause))
+		{
+			*nElems = 1.0;
+			return -1;
+		}
+
+		*nElems = estimate_array_length(operand);
+		*strategy = get_op_opfamily_strategy(opno, index->opfamily[i]);
+		return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Index is always read fully, so the cost depends on its size and on
+ * number of compared tuples, and its selectivity is the selectivity of
+ * quals increased by false positives of signatures. Tuple of non-matching
+ * row has K = sum(bits of column * not null fraction) bits set of
+ * m signature bits, array column sets bits of each its element and
+ * null-markers add bits of column * null fraction. Each bit
+ * is set with probability 1 - exp(-K/m), and query sets Q = sum(bits of
+ * queried columns) bits, bits of all elements of contained array and of
+ * one element of overlapping, so false positive rate is
+ * (1 - exp(-K/m)) ^ Q. Page summary is OR of tuplesPerPage
+ * signatures, so page is skipped with the same formula with K multiplied
+ * by tuplesPerPage. Heap fetches for rechecks are costed by caller with
+ * help of returned selectivity.
+ */
 PG_FUNCTION_INFO_V1(blcostestimate);
 Datum       blcostestimate(PG_FUNCTION_ARGS);
 Datum
 blcostestimate(PG_FUNCTION_ARGS)
 {
-	/* PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0); */
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
 	IndexOptInfo *index = (IndexOptInfo *) PG_GETARG_POINTER(1);
-	/* List       *indexQuals = (List *) PG_GETARG_POINTER(2); */
+	List       *indexQuals = (List *) PG_GETARG_POINTER(2);
 	RelOptInfo *outer_rel = (RelOptInfo *) PG_GETARG_POINTER(3);
 	Cost       *indexStartupCost = (Cost *) PG_GETARG_POINTER(4);
 	Cost       *indexTotalCost = (Cost *) PG_GETARG_POINTER(5);
-	/* Selectivity *indexSelectivity = (Selectivity *) PG_GETARG_POINTER(6); */
-	/* double     *indexCorrelation = (double *) PG_GETARG_POINTER(7); */
-
-	/* we believe that gistcostestimate just call generic cost estimate */
-	DirectFunctionCall8(
-		gistcostestimate,
-		PG_GETARG_DATUM(0),
-		PG_GETARG_DATUM(1),
-		PG_GETARG_DATUM(2),
-		PG_GETARG_DATUM(3),
-		PG_GETARG_DATUM(4),
-		PG_GETARG_DATUM(5),
-		PG_GETARG_DATUM(6),
-		PG_GETARG_DATUM(7)
-	);
-
-	*indexStartupCost = 0;
-	*indexTotalCost = index->pages * seq_page_cost / 2 /* cache effects */;
+	Selectivity *indexSelectivity = (Selectivity *) PG_GETARG_POINTER(6);
+	double     *indexCorrelation = (double *) PG_GETARG_POINTER(7);
+	Relation	rel;
+	BloomState	*state;
+	double		nBits,
+				tupleBits = 0.0,
+				queryBits = 0.0,
+				tuplesPerPage,
+				fpr,
+				pageMatch,
+				qualSelectivity,
+				numScans = 1.0,
+				nSigns = 1.0,
+				pagesFetched;
+	bool		queried[INDEX_MAX_KEYS],
+				sliced;
+	ListCell	*l;
+	int			i;
+
+	rel = index_open(index->indexoid, NoLock);
+	state = BloomGetState(rel);
+
+	nBits = state->opts->bloomLength * BITSIGNTYPE;
+	sliced = state->opts->sliced;
+	for(i=0; i<index->ncolumns; i++)
+	{
+		double	nullfrac;
+		int32	width;
+
+		nullfrac = columnNullFrac(root, index, i, &width);
+		/* array sets bits of every element, NULL sets null-marker if any */
+		tupleBits += state->opts->bitSize[i] * (1.0 - nullfrac) *
+			(OidIsValid(state->elemType[i]) ?
+				BloomArrayElements(state->elemType[i], width) : 1.0);
+		if (state->opts->nulls)
+			tupleBits += state->opts->bitSize[i] * nullfrac;
+		queried[i] = false;
+	}
+
+	foreach(l, indexQuals)
+	{
+		RestrictInfo	*rinfo = (RestrictInfo *) lfirst(l);
+		double			nElems;
+		int				col,
+						strategy;
+
+		Assert(IsA(rinfo, RestrictInfo));
+		col = qualIndexColumn(index, rinfo, state->opts->nulls, &nElems, &strategy);
+
+		if (col >= 0 && OidIsValid(state->elemType[col]) &&
+			strategy != BLOOM_OVERLAP_STRATEGY)
+		{
+			/* all elements of array operand are in one signature */
+			queryBits += state->opts->bitSize[col] * Max(nElems, 1.0);
+			queried[col] = true;
+			continue;
+		}
+
+		/* every combination of array elements is a query signature */
+		nSigns = Min(nSigns * Max(nElems, 1.0), MaxBloomQuerySigns);
+		if (col >= 0 && !queried[col])
+		{
+			queried[col] = true;
+			queryBits += state->opts->bitSize[col];
+		}
+	}
+
+	index_close(rel, NoLock);
+
+	qualSelectivity = clauselist_selectivity(root, indexQuals,
+											 index->rel->relid, JOIN_INNER, NULL);
+
+	/* without keys fpr is 1: everything matches */
+	fpr = pow(1.0 - exp(-tupleBits / nBits), queryBits) * nSigns;
+	CLAMP_PROBABILITY(fpr);
+	*indexSelectivity = qualSelectivity + (1.0 - qualSelectivity) * fpr;
+	CLAMP_PROBABILITY(*indexSelectivity);
+
+	/* measured fill of pages, metapage isn't counted */
+	tuplesPerPage = (index->pages > 1) ? index->tuples / (index->pages - 1) : 0.0;
+	pageMatch = pow(1.0 - exp(-tupleBits * tuplesPerPage / nBits), queryBits);
+	/* pages with real matches can't be skipped */
+	pageMatch = 1.0 - (1.0 - pageMatch) * (1.0 - Min(qualSelectivity * tuplesPerPage, 1.0));
+	/* bit-sliced pages have no summary, but only slices of query bits are read */
+	if (sliced)
+		pageMatch = queryBits / nBits;
+
+	/* every signature is checked against pages which could match */
+	pageMatch *= nSigns;
+
+	/*
+	 * Repeated scans of inner side of nestloop could find pages in cache,
+	 * cost is for one scan
+	 */
 	if (outer_rel != NULL && outer_rel->rows > 1)
-		*indexTotalCost  *= outer_rel->rows;
+		numScans = outer_rel->rows;
+
+	pagesFetched = index->pages;
+	if (numScans > 1)
+	{
+		pagesFetched = index_pages_fetched(pagesFetched * numScans, index->pages,
+										   (double) index->pages, root) / numScans;
+		/* since the second scan rescans use copy of index in memory */
+		if (index->pages <= (work_mem * 1024L) / BLCKSZ)
+			pagesFetched = Min(pagesFetched, 2.0 * index->pages / numScans);
+	}
+
+	/* signatures of query: hash calls per qual or array element */
+	*indexStartupCost = list_length(indexQuals) * nSigns * cpu_operator_cost;
+
+	*indexTotalCost = *indexStartupCost +
+		pagesFetched * seq_page_cost +
+		/* check of page summary */
+		index->pages * cpu_operator_cost +
+		/* tuples of not skipped pages are compared */
+		index->tuples * pageMatch * cpu_index_tuple_cost +
+		index->tuples * (*indexSelectivity) * cpu_operator_cost;
+
+	*indexCorrelation = 0.0;
 
 	PG_RETURN_VOID();
 }
@@ -1,10 +1,16 @@
 #include "postgres.h"
 
 #include "access/genam.h"
+#include "access/heapam.h"
+#include "access/xact.h"
 #include "catalog/index.h"
+#include "executor/executor.h"
 #include "miscadmin.h"
 #include "storage/bufmgr.h"
+#include "storage/freespace.h"
 #include "storage/indexfsm.h"
+#include "storage/smgr.h"
+#include "tcop/utility.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
 
@@ -12,48 +18,63 @@
 
 PG_MODULE_MAGIC;
 
+/*
+ * Index is built bypassing shared buffers like nbtree's sorted build:
+ * tuples are added into a backend-local page image and full pages are
+ * appended to the relation by smgrextend(). Only metapage goes through
+ * buffer manager.
+ */
 typedef struct
 {
 	BloomState		blstate;
 	MemoryContext	tmpCtx;
-	Buffer			currentBuffer;
-	Page			currentPage;
+	Page			page;		/* page being filled */
+	BlockNumber		blkno;		/* block number of page */
+	BloomTuple		*itup;		/* room to make tuple */
+	bool			useWal;		/* log pages for archive and standby */
 } BloomBuildState;
 
+static void
+flushBuildPage(Relation index, BloomBuildState *buildstate)
+{
+	/* log_newpage() sets LSN of page, so it goes before write */
+	if (buildstate->useWal)
+		log_newpage(&index->rd_node, MAIN_FORKNUM, buildstate->blkno,
+					buildstate->page);
+
+	/* Ensure rd_smgr is open (could have been closed by relcache flush!) */
+	RelationOpenSmgr(index);
+	smgrextend(index->rd_smgr, MAIN_FORKNUM, buildstate->blkno, 
+				(char*)buildstate->page, true);
+}
+
 static void
 bloomBuildCallback(Relation index, HeapTuple htup, Datum *values,
 					bool *isnull, bool tupleIsAlive, void *state)
 {
 	BloomBuildState	*buildstate = (BloomBuildState*)state;
 	MemoryContext	oldCtx;
-	BloomTuple		*itup;
 
+	/* hash functions could leak a bit, tmpCtx is reset once per page */
 	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
 
-	itup = BloomFormTuple(&buildstate->blstate, &htup->t_self, values, isnull);
+	BloomFillTuple(&buildstate->blstate, buildstate->itup, &htup->t_self, values, isnull);
 
-	if (buildstate->currentBuffer == InvalidBuffer ||
-			BloomPageAddItem(&buildstate->blstate, buildstate->currentPage, itup) == false) 
+	if (BloomPageAddItem(&buildstate->blstate, buildstate->page, buildstate->itup) == false) 
 	{
-		if (buildstate->currentBuffer != InvalidBuffer)
-		{
-			MarkBufferDirty(buildstate->currentBuffer);
-			UnlockReleaseBuffer(buildstate->currentBuffer);
-		}
+		flushBuildPage(index, buildstate);
+		buildstate->blkno++;
 
 		CHECK_FOR_INTERRUPTS();
 
-		/* BloomNewBuffer returns locked page */
-		buildstate->currentBuffer = BloomNewBuffer(index);
-		BloomInitBuffer(buildstate->currentBuffer, 0);
-		buildstate->currentPage = BufferGetPage(buildstate->currentBuffer);
+		BloomInitDataPage(&buildstate->blstate, buildstate->page, BLCKSZ);
+		MemoryContextReset(buildstate->tmpCtx);
 		
-		if (BloomPageAddItem(&buildstate->blstate, buildstate->currentPage, itup) == false)
+		if (BloomPageAddItem(&buildstate->blstate, buildstate->page, buildstate->itup) == false)
 			elog(ERROR, "can not add new tuple"); /* should not be here! */
 	}
 
 	MemoryContextSwitchTo(oldCtx);
-	MemoryContextReset(buildstate->tmpCtx);
 }
 
 PG_FUNCTION_INFO_V1(blbuild);
@@ -67,20 +88,22 @@ blbuild(PG_FUNCTION_ARGS)
 	IndexBuildResult *result;
 	double      reltuples;
 	BloomBuildState buildstate;
-	Buffer		MetaBuffer;
 
 	if (RelationGetNumberOfBlocks(index) != 0)
 		elog(ERROR, "index \"%s\" already contains data",
 			RelationGetRelationName(index));
 
-	/* initialize the meta page */
-	MetaBuffer = BloomNewBuffer(index);
+	/* without archiving smgrimmedsync() below is enough, like in nbtree */
+	buildstate.useWal = XLogIsNeeded() && RelationNeedsWAL(index);
 
-	START_CRIT_SECTION();
-	BloomInitMetabuffer(MetaBuffer, index);
-	MarkBufferDirty(MetaBuffer);
-	END_CRIT_SECTION();
-	UnlockReleaseBuffer(MetaBuffer);
+	/* 
+	 * write the meta page, it should be on disk before initBloomState()
+	 * reads it through shared buffers
+	 */
+	buildstate.page = (Page) palloc(BLCKSZ);
+	BloomInitMetapage(buildstate.page, BLCKSZ, index);
+	buildstate.blkno = BLOOM_METAPAGE_BLKNO;
+	flushBuildPage(index, &buildstate);
 
 	initBloomState(&buildstate.blstate, index);
 
@@ -90,19 +113,44 @@ blbuild(PG_FUNCTION_ARGS)
 												ALLOCSET_DEFAULT_INITSIZE,
 												ALLOCSET_DEFAULT_MAXSIZE);
 
-	buildstate.currentBuffer = InvalidBuffer;
+	buildstate.itup = palloc(buildstate.blstate.sizeOfBloomTuple);
+	buildstate.blkno = BLOOM_HEAD_BLKNO;
+	BloomInitDataPage(&buildstate.blstate, buildstate.page, BLCKSZ);
 
 	reltuples = IndexBuildHeapScan(heap, index, indexInfo, true,
 									bloomBuildCallback, (void *) &buildstate);
 
-	/* close opened buffer */
-	if (buildstate.currentBuffer != InvalidBuffer)
+	/* write the last page */
+	if (BloomPageGetMaxOffset(buildstate.page) > 0)
 	{
-		MarkBufferDirty(buildstate.currentBuffer);
-		UnlockReleaseBuffer(buildstate.currentBuffer);
+		flushBuildPage(index, &buildstate);
+
+		/* 
+		 * offer the last page to inserts, otherwise the first insert
+		 * allocates new page and this one stays half-empty until vacuum
+		 */
+		if (BloomPageGetFreeTuples(&buildstate.blstate, buildstate.page) > 0)
+		{
+			RecordPageWithFreeSpace(index, buildstate.blkno,
+						BloomPageGetFsmSpace(&buildstate.blstate, buildstate.page));
+			IndexFreeSpaceMapVacuum(index);
+		}
+	}
+
+	/*
+	 * Pages were written bypassing shared buffers, so they should reach
+	 * disk before commit even if they are WAL-logged: checkpoint could
+	 * happen after WAL record was written and wouldn't flush them.
+	 */
+	if (index->rd_rel->relpersistence == RELPERSISTENCE_PERMANENT)
+	{
+		RelationOpenSmgr(index);
+		smgrimmedsync(index->rd_smgr, MAIN_FORKNUM);
 	}
 
 	MemoryContextDelete(buildstate.tmpCtx);
+	pfree(buildstate.itup);
+	pfree(buildstate.page);
 
 	result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
 	result->heap_tuples = result->index_tuples = reltuples;
@@ -110,46 +158,440 @@ blbuild(PG_FUNCTION_ARGS)
 	PG_RETURN_POINTER(result);
 }
 
+/*
+ * Build empty index of unlogged table: init fork consists of metapage
+ * only, it's copied over the main fork after crash
+ */
 PG_FUNCTION_INFO_V1(blbuildempty);
 Datum       blbuildempty(PG_FUNCTION_ARGS);
 Datum
 blbuildempty(PG_FUNCTION_ARGS)
 {
-	elog(NOTICE, "blbuildempty: FIX ME");
-        ereport(ERROR,
-                        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                         errmsg("unlogged bloom indexes are not supported")));
+	Relation	index = (Relation) PG_GETARG_POINTER(0);
+	Page		metapage;
+
+	metapage = (Page) palloc(BLCKSZ);
+	BloomInitMetapage(metapage, BLCKSZ, index);
 
-        PG_RETURN_VOID();
+	/* Write the page. If archiving/streaming, XLOG it. */
+	RelationOpenSmgr(index);
+	smgrwrite(index->rd_smgr, INIT_FORKNUM, BLOOM_METAPAGE_BLKNO,
+			  (char *) metapage, true);
+	if (XLogIsNeeded())
+		log_newpage(&index->rd_node, INIT_FORKNUM, BLOOM_METAPAGE_BLKNO,
+					metapage);
+
+	/*
+	 * Init fork is not written through shared buffers, so checkpoint
+	 * doesn't know about it: sync it right now.
+	 */
+	smgrimmedsync(index->rd_smgr, INIT_FORKNUM);
+
+	pfree(metapage);
+
+	PG_RETURN_VOID();
 }
 
-static bool
-addItemToBlock(Relation index, BloomState *state, BloomTuple *itup, BlockNumber blkno)
+/*
+ * Add leading tuples of array into page while they fit, returns number of
+ * added tuples. Page is locked and dirtied only once for all of them.
+ * Deleted page is reused as a new one. fsmSpace gets free space of page
+ * left for FSM.
+ */
+static int
+addItemsToBlock(Relation index, BloomState *state, char *tuples, int nTuples,
+				BlockNumber blkno, Size *fsmSpace)
 {
 	Buffer		buffer;
 	Page		page;
+	int			n = 0;
 
 	buffer = ReadBuffer(index, blkno);
 	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
 	page = BufferGetPage(buffer);
 
+	if (!PageIsNew(page) && BloomPageIsMeta(page))
+	{
+		UnlockReleaseBuffer(buffer);
+		*fsmSpace = 0;
+		return 0;
+	}
+
 	START_CRIT_SECTION();
-	if (BloomPageAddItem(state, page, itup))
+	if (PageIsNew(page) || BloomPageIsDeleted(page))
+		BloomInitDataBuffer(state, buffer);
+
+	while(n < nTuples && 
+			BloomPageAddItem(state, page, 
+							 (BloomTuple*)(tuples + n * state->sizeOfBloomTuple)))
+		n++;
+
+	if (n > 0)
 	{
-		/* inserted */
-		END_CRIT_SECTION();
 		MarkBufferDirty(buffer);
-		UnlockReleaseBuffer(buffer);
-		return true;
+		BloomLogPage(index, buffer);
+	}
+	END_CRIT_SECTION();
+
+	*fsmSpace = BloomPageGetFsmSpace(state, page);
+
+	UnlockReleaseBuffer(buffer);
+
+	return n;
+}
+
+/*
+ * Put leading tuples of array into one page, returns number of placed
+ * tuples, at least one.
+ *
+ * Every backend remembers the page of its last insert as relation's
+ * target block and looks for another page only when it is full. Pages
+ * with free space, left by vacuum, and deleted pages are found in FSM,
+ * which spreads concurrent searchers over different pages. Page is
+ * forgotten by FSM when it gets full.
+ */
+static int
+placeTuples(Relation index, BloomState *state, char *tuples, int nTuples)
+{
+	Buffer				buffer;
+	BlockNumber			blkno;
+	Size				fsmSpace;
+	int					n;
+
+	/*
+	 * vacuum truncates index only under AccessExclusiveLock, and smgr
+	 * invalidation sent by truncation resets target block
+	 */
+	blkno = RelationGetTargetBlock(index);
+	if (blkno != InvalidBlockNumber &&
+			(n =addItemsToBlock(index, state, tuples, nTuples, blkno, &fsmSpace)) > 0)
+		return n;
+
+	while((blkno = GetPageWithFreeSpace(index, BLOOM_FSM_MIN_SPACE)) != InvalidBlockNumber)
+	{
+		n = addItemsToBlock(index, state, tuples, nTuples, blkno, &fsmSpace);
+		RecordPageWithFreeSpace(index, blkno, fsmSpace);
+
+		if (n > 0)
+		{
+			RelationSetTargetBlock(index, blkno);
+			return n;
+		}
+	}
+
+	/* no free pages */
+	buffer = BloomNewBuffer(index);
+
+	START_CRIT_SECTION();
+	BloomInitDataBuffer(state, buffer);
+
+	n = 0;
+	while(n < nTuples &&
+			BloomPageAddItem(state, BufferGetPage(buffer),
+							 (BloomTuple*)(tuples + n * state->sizeOfBloomTuple)))
+		n++;
+	Assert(n > 0);
+
+	MarkBufferDirty(buffer);
+	BloomLogPage(index, buffer);
+	END_CRIT_SECTION();
+
+	RelationSetTargetBlock(index, BufferGetBlockNumber(buffer));
+
+	UnlockReleaseBuffer(buffer);
+
+	return n;
+}
+
+/*
+ * Batched insertion. Inside of executor run or COPY FROM tuples are
+ * collected in backend-local buffer of one page size per index and put
+ * into index by placeTuples() a page at a time. Buffers are flushed when
+ * full, at the end of every executor run and utility statement, and
+ * before a scan of the same index, so the statement which inserted heap
+ * tuples always sees their index tuples. Other backends can't see the
+ * heap tuples before commit anyway.
+ *
+ * Buffers belong to subtransaction which collected them: on its abort
+ * they are just forgotten, because their heap tuples are dead and the
+ * index could even not exist anymore.
+ */
+typedef struct BloomPendingInsert
+{
+	Oid				indexOid;
+	SubTransactionId subid;
+	int				start;		/* first not flushed tuple */
+	int				nTuples;
+	int				maxTuples;
+	char			*tuples;
+	struct BloomPendingInsert *next;
+} BloomPendingInsert;
+
+/* allocated in TopTransactionContext */
+static BloomPendingInsert *pendingInserts = NULL;
+
+/* number of executor runs and COPY FROM in progress */
+static int	batchDepth = 0;
+
+/*
+ * batchDepth at start of every open subtransaction: executor runs and
+ * COPY FROM aborted with subtransaction don't reach their end, so abort
+ * restores the depth. Allocated in TopTransactionContext.
+ */
+typedef struct BloomSubXactDepth
+{
+	SubTransactionId	subid;
+	int					batchDepth;
+	struct BloomSubXactDepth *next;
+} BloomSubXactDepth;
+
+static BloomSubXactDepth *subXactDepths = NULL;
+
+/*
+ * Short-lived memory of inserts, reset after every blinsert() and
+ * flushPending(). Hash functions of varlena types could leave detoasted
+ * copies of values, and arrays are deconstructed.
+ */
+static MemoryContext insertCtx = NULL;
+
+static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+
+static MemoryContext
+getInsertContext(void)
+{
+	if (insertCtx == NULL)
+		insertCtx = AllocSetContextCreate(TopMemoryContext,
+										  "Bloom insert temporary context",
+										  ALLOCSET_SMALL_MINSIZE,
+										  ALLOCSET_SMALL_INITSIZE,
+										  ALLOCSET_SMALL_MAXSIZE);
+
+	return insertCtx;
+}
+
+static void
+flushPending(BloomPendingInsert *pending)
+{
+	Relation		index;
+	BloomState		*state;
+	MemoryContext	oldCtx;
+
+	if (pending->start >= pending->nTuples)
+		return;
+
+	/* lock is already held since insert */
+	index = index_open(pending->indexOid, RowExclusiveLock);
+	state = BloomGetState(index);
+	oldCtx = MemoryContextSwitchTo(getInsertContext());
+
+	/* 
+	 * start is advanced after every page, so if error happens, placed 
+	 * tuples aren't placed again by subtransaction's owner
+	 */
+	while(pending->start < pending->nTuples)
+		pending->start += placeTuples(index, state, 
+						pending->tuples + pending->start * state->sizeOfBloomTuple,
+						pending->nTuples - pending->start);
+
+	pending->start = pending->nTuples = 0;
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(insertCtx);
+	index_close(index, NoLock);
+}
+
+/*
+ * Flush pending tuples of index, or of all indexes if indexOid is invalid.
+ * In the latter case buffers are freed.
+ */
+void
+BloomFlushInserts(Oid indexOid)
+{
+	BloomPendingInsert	*pending;
+
+	if (OidIsValid(indexOid))
+	{
+		for(pending = pendingInserts; pending; pending = pending->next)
+			if (pending->indexOid == indexOid)
+				flushPending(pending);
+		return;
+	}
+
+	while(pendingInserts)
+	{
+		pending = pendingInserts;
+		flushPending(pending);
+		pendingInserts = pending->next;
+		pfree(pending->tuples);
+		pfree(pending);
 	}
+}
+
+static BloomPendingInsert *
+getPending(Relation index, BloomState *state)
+{
+	BloomPendingInsert	*pending;
+	SubTransactionId	subid = GetCurrentSubTransactionId();
+
+	for(pending = pendingInserts; pending; pending = pending->next)
+		if (pending->indexOid == RelationGetRelid(index) && pending->subid == subid)
+			return pending;
+
+	pending = MemoryContextAllocZero(TopTransactionContext, sizeof(BloomPendingInsert));
+	pending->indexOid = RelationGetRelid(index);
+	pending->subid = subid;
+	pending->maxTuples = state->pageCapacity;
+	pending->tuples = MemoryContextAlloc(TopTransactionContext,
+										 pending->maxTuples * state->sizeOfBloomTuple);
+	pending->next = pendingInserts;
+	pendingInserts = pending;
+
+	return pending;
+}
+
+static void
+bloomExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	batchDepth++;
+
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
 	else
+		standard_ExecutorStart(queryDesc, eflags);
+}
+
+static void
+bloomExecutorEnd(QueryDesc *queryDesc)
+{
+	BloomFlushInserts(InvalidOid);
+	if (batchDepth > 0)
+		batchDepth--;
+
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
+
+static void
+bloomProcessUtility(Node *parsetree, const char *queryString,
+					ParamListInfo params, bool isTopLevel,
+					DestReceiver *dest, char *completionTag)
+{
+	bool	isCopyFrom = IsA(parsetree, CopyStmt) && ((CopyStmt*)parsetree)->is_from;
+
+	/* utility could drop, truncate or rebuild index */
+	if (IsTransactionState())
+		BloomFlushInserts(InvalidOid);
+
+	if (isCopyFrom)
+		batchDepth++;
+
+	if (prev_ProcessUtility)
+		prev_ProcessUtility(parsetree, queryString, params, isTopLevel,
+							dest, completionTag);
+	else
+		standard_ProcessUtility(parsetree, queryString, params, isTopLevel,
+								dest, completionTag);
+
+	if (isCopyFrom && batchDepth > 0)
+		batchDepth--;
+
+	if (IsTransactionState())
+		BloomFlushInserts(InvalidOid);
+}
+
+static void
+bloomXactCallback(XactEvent event, void *arg)
+{
+	BloomPendingInsert	*pending;
+
+	/*
+	 * Every statement flushes its tuples at the end, so nothing is left
+	 * at commit. It's too late to write the index here: commit record is
+	 * already written and error would be promoted to PANIC, so only
+	 * complain loudly.
+	 */
+	if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_PREPARE)
 	{
-		END_CRIT_SECTION();
-		UnlockReleaseBuffer(buffer);
-		return false;
+		for(pending = pendingInserts; pending; pending = pending->next)
+		{
+			Assert(pending->start >= pending->nTuples);
+			if (pending->start < pending->nTuples)
+				elog(WARNING, "%d tuples of bloom index %u were not inserted, index should be rebuilt",
+					 pending->nTuples - pending->start, pending->indexOid);
+		}
+	}
+
+	/* memory goes away with TopTransactionContext */
+	pendingInserts = NULL;
+	subXactDepths = NULL;
+	batchDepth = 0;
+}
+
+static void
+bloomSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+					 SubTransactionId parentSubid, void *arg)
+{
+	BloomPendingInsert	**prev = &pendingInserts,
+						*pending;
+	BloomSubXactDepth	*depth;
+
+	if (event == SUBXACT_EVENT_START_SUB)
+	{
+		depth = MemoryContextAlloc(TopTransactionContext, sizeof(BloomSubXactDepth));
+		depth->subid = mySubid;
+		depth->batchDepth = batchDepth;
+		depth->next = subXactDepths;
+		subXactDepths = depth;
+		return;
+	}
+
+	/* subtransaction could start before the module was loaded */
+	if (subXactDepths && subXactDepths->subid == mySubid)
+	{
+		depth = subXactDepths;
+		if (event == SUBXACT_EVENT_ABORT_SUB)
+			batchDepth = depth->batchDepth;
+		subXactDepths = depth->next;
+		pfree(depth);
+	}
+
+	while((pending = *prev) != NULL)
+	{
+		if (pending->subid == mySubid && event == SUBXACT_EVENT_ABORT_SUB)
+		{
+			*prev = pending->next;
+			pfree(pending->tuples);
+			pfree(pending);
+			continue;
+		}
+
+		if (pending->subid == mySubid && event == SUBXACT_EVENT_COMMIT_SUB)
+			pending->subid = parentSubid;
+		prev = &pending->next;
 	}
 }
 
+/*
+ * Install hooks, called from _PG_init()
+ */
+void
+BloomInitInsertBatch(void)
+{
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = bloomExecutorStart;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = bloomExecutorEnd;
+	prev_ProcessUtility = ProcessUtility_hook;
+	ProcessUtility_hook = bloomProcessUtility;
+
+	RegisterXactCallback(bloomXactCallback, NULL);
+	RegisterSubXactCallback(bloomSubXactCallback, NULL);
+}
+
 PG_FUNCTION_INFO_V1(blinsert);
 Datum       blinsert(PG_FUNCTION_ARGS);
 Datum
@@ -163,92 +605,36 @@ blinsert(PG_FUNCTION_ARGS)
     Relation    heapRel = (Relation) PG_GETARG_POINTER(4);
 	IndexUniqueCheck checkUnique = (IndexUniqueCheck) PG_GETARG_INT32(5);
 #endif
-	BloomState   	 blstate;
-	BloomTuple		*itup;
-	MemoryContext 	oldCtx;
-	MemoryContext 	insertCtx;
-	BloomMetaPageData	*metaData;
-	Buffer				metaBuffer,
-						buffer;
-	BlockNumber			blkno = InvalidBlockNumber;
-
-	insertCtx = AllocSetContextCreate(CurrentMemoryContext,
-										"Bloom insert temporary context",
-										ALLOCSET_DEFAULT_MINSIZE,
-										ALLOCSET_DEFAULT_INITSIZE,
-										ALLOCSET_DEFAULT_MAXSIZE);
-
-	oldCtx = MemoryContextSwitchTo(insertCtx);
-
-	initBloomState(&blstate, index);
-	itup = BloomFormTuple(&blstate, ht_ctid, values, isnull);
-
-	metaBuffer = ReadBuffer(index, BLOOM_METAPAGE_BLKNO);
-	LockBuffer(metaBuffer, BUFFER_LOCK_SHARE);
-	metaData = BloomPageGetMeta(BufferGetPage(metaBuffer));
-
-	if (metaData->nEnd > metaData->nStart)
-	{
-		blkno = metaData->notFullPage[ metaData->nStart ];
+	BloomState   	 	*blstate;
+	BloomTupleBuffer	buf;
+	BloomPendingInsert	*pending;
+	MemoryContext		oldCtx;
 
-		Assert(blkno != InvalidBlockNumber);
-		LockBuffer(metaBuffer, BUFFER_LOCK_UNLOCK);
+	/* cached state and tuple on stack, only hash functions allocate */
+	blstate = BloomGetState(index);
+	oldCtx = MemoryContextSwitchTo(getInsertContext());
 
-		if (addItemToBlock(index, &blstate, itup, blkno))
-			goto away;
-	}
-	else
+	if (batchDepth == 0)
 	{
-		/* no avaliable pages */
-		LockBuffer(metaBuffer, BUFFER_LOCK_UNLOCK);
+		/* nobody would flush the buffer, insert right now */
+		BloomFillTuple(blstate, &buf.tuple, ht_ctid, values, isnull);
+		placeTuples(index, blstate, (char*)&buf.tuple, 1);
 	}
-
-	/* protect any changes on metapage with a help of CRIT_SECTION */
-
-	LockBuffer(metaBuffer, BUFFER_LOCK_EXCLUSIVE);
-	START_CRIT_SECTION();
-	if ( metaData->nEnd > metaData->nStart && 
-		blkno == metaData->notFullPage[ metaData->nStart ] )
-		metaData->nStart++;
-	END_CRIT_SECTION();
-			
-	while( metaData->nEnd > metaData->nStart )
+	else
 	{
-		blkno = metaData->notFullPage[ metaData->nStart ];
-
-		Assert(blkno != InvalidBlockNumber);
-		if (addItemToBlock(index, &blstate, itup, blkno))
-		{
-			MarkBufferDirty(metaBuffer);
-			LockBuffer(metaBuffer, BUFFER_LOCK_UNLOCK);
-			goto away;
-		}
-
-		START_CRIT_SECTION();
-		metaData->nStart++;
-		END_CRIT_SECTION();
+		pending = getPending(index, blstate);
+		BloomFillTuple(blstate, 
+					   (BloomTuple*)(pending->tuples + pending->nTuples * blstate->sizeOfBloomTuple),
+					   ht_ctid, values, isnull);
+		pending->nTuples++;
+
+		/* buffer is exactly a page */
+		if (pending->nTuples >= pending->maxTuples)
+			flushPending(pending);
 	}
 
-	/* no free pages */
-	buffer = BloomNewBuffer(index);
-	BloomInitBuffer(buffer, 0);
-	BloomPageAddItem(&blstate, BufferGetPage(buffer), itup);
-
-	START_CRIT_SECTION();
-	metaData->nStart = 0;
-	metaData->nEnd = 1;
-	metaData->notFullPage[ 0 ] = BufferGetBlockNumber(buffer);
-	END_CRIT_SECTION();
-
-	MarkBufferDirty(metaBuffer);
-	MarkBufferDirty(buffer);
-	UnlockReleaseBuffer(buffer);
-	LockBuffer(metaBuffer, BUFFER_LOCK_UNLOCK);
-
-away:
-	ReleaseBuffer(metaBuffer);
 	MemoryContextSwitchTo(oldCtx);
-	MemoryContextDelete(insertCtx);
+	MemoryContextReset(insertCtx);
 
 	PG_RETURN_BOOL(false);
 }
@@ -0,0 +1,205 @@
+#include "postgres.h"
+
+#include "bloom.h"
+
+/*
+ * Signature match kernels. Kernel checks nTuples tuples of tupleSize bytes
+ * starting at tuples and sets i-th bit of match if all bits of sign are set
+ * in i-th tuple. Vectorized kernels may read past the end of signature, but
+ * never at or beyond limit.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2_WITH_RUNTIME_CHECK
+#endif
+
+#if defined(__SSE2__) || defined(USE_AVX2_WITH_RUNTIME_CHECK)
+#include <immintrin.h>
+#endif
+
+static void
+clearMatch(int nTuples, BloomSliceWord *match)
+{
+	memset(match, 0, sizeof(BloomSliceWord) *
+				((nTuples + BITSLICEWORD - 1) / BITSLICEWORD));
+}
+
+/*
+ * Scalar version, no branch inside of signature
+ */
+static void
+matchTuplesFrom(SignType *sign, int signLen, char *tuples, int from,
+				int nTuples, int tupleSize, BloomSliceWord *match)
+{
+	int		i, w;
+
+	for(i=from; i<nTuples; i++)
+	{
+		SignType	*itupSign = ((BloomTuple*)(tuples + i * tupleSize))->sign;
+		SignType	diff = 0;
+
+		for(w=0; w<signLen; w++)
+			diff |= (itupSign[w] & sign[w]) ^ sign[w];
+
+		if (diff == 0)
+			SLICESETBIT(match, i);
+	}
+}
+
+static void
+matchTuplesScalar(SignType *sign, int signLen, char *tuples, int nTuples,
+					int tupleSize, char *limit, BloomSliceWord *match)
+{
+	clearMatch(nTuples, match);
+	matchTuplesFrom(sign, signLen, tuples, 0, nTuples, tupleSize, match);
+}
+
+#if defined(__SSE2__) || defined(USE_AVX2_WITH_RUNTIME_CHECK)
+/*
+ * Returns number of leading tuples which could be checked by loading
+ * nChunks chunks of chunkSize bytes from the start of its signature.
+ */
+static int
+vectorizableTuples(char *tuples, int nTuples, int tupleSize, char *limit,
+					int nChunks, int chunkSize)
+{
+	long	avail = limit - tuples - BLOOMTUPLEHDRSZ - nChunks * chunkSize;
+
+	if (avail < 0)
+		return 0;
+
+	return Min(avail / tupleSize + 1, nTuples);
+}
+#endif
+
+#ifdef __SSE2__
+/*
+ * SSE2: signature is compared by 16-byte chunks, query signature is padded
+ * by zeros, so garbage behind the tuple's signature always matches.
+ */
+static void
+matchTuplesSSE2(SignType *sign, int signLen, char *tuples, int nTuples,
+				int tupleSize, char *limit, BloomSliceWord *match)
+{
+	int			chunkLen = sizeof(__m128i) / sizeof(SignType);
+	int			nChunks = (signLen + chunkLen - 1) / chunkLen;
+	SignType	query[BLOOM_MAX_LENGTH + sizeof(__m128i) / sizeof(SignType)];
+	__m128i		q[BLOOM_MAX_LENGTH / (sizeof(__m128i) / sizeof(SignType)) + 1];
+	int			nVector,
+				i, c;
+
+	memset(query, 0, sizeof(query));
+	memcpy(query, sign, sizeof(SignType) * signLen);
+	for(c=0; c<nChunks; c++)
+		q[c] = _mm_loadu_si128((__m128i*)(query + c * chunkLen));
+
+	clearMatch(nTuples, match);
+	nVector = vectorizableTuples(tuples, nTuples, tupleSize, limit,
+								 nChunks, sizeof(__m128i));
+
+	for(i=0; i<nVector; i++)
+	{
+		char	*s = (char*)((BloomTuple*)(tuples + i * tupleSize))->sign;
+		__m128i	eq = _mm_set1_epi8(-1);
+
+		for(c=0; c<nChunks; c++)
+		{
+			__m128i	t = _mm_loadu_si128((__m128i*)(s + c * sizeof(__m128i)));
+
+			eq = _mm_and_si128(eq,
+					_mm_cmpeq_epi16(_mm_and_si128(t, q[c]), q[c]));
+		}
+
+		if (_mm_movemask_epi8(eq) == 0xFFFF)
+			SLICESETBIT(match, i);
+	}
+
+	matchTuplesFrom(sign, signLen, tuples, i, nTuples, tupleSize, match);
+}
+#endif
+
+#ifdef USE_AVX2_WITH_RUNTIME_CHECK
+/*
+ * AVX2: the same as SSE2 with 32-byte chunks
+ */
+__attribute__((target("avx2")))
+static void
+matchTuplesAVX2(SignType *sign, int signLen, char *tuples, int nTuples,
+				int tupleSize, char *limit, BloomSliceWord *match)
+{
+	int			chunkLen = sizeof(__m256i) / sizeof(SignType);
+	int			nChunks = (signLen + chunkLen - 1) / chunkLen;
+	SignType	query[BLOOM_MAX_LENGTH + sizeof(__m256i) / sizeof(SignType)];
+	__m256i		q[BLOOM_MAX_LENGTH / (sizeof(__m256i) / sizeof(SignType)) + 1];
+	int			nVector,
+				i, c;
+
+	memset(query, 0, sizeof(query));
+	memcpy(query, sign, sizeof(SignType) * signLen);
+	for(c=0; c<nChunks; c++)
+		q[c] = _mm256_loadu_si256((__m256i*)(query + c * chunkLen));
+
+	clearMatch(nTuples, match);
+	nVector = vectorizableTuples(tuples, nTuples, tupleSize, limit,
+								 nChunks, sizeof(__m256i));
+
+	for(i=0; i<nVector; i++)
+	{
+		char	*s = (char*)((BloomTuple*)(tuples + i * tupleSize))->sign;
+		__m256i	eq = _mm256_set1_epi8(-1);
+
+		for(c=0; c<nChunks; c++)
+		{
+			__m256i	t = _mm256_loadu_si256((__m256i*)(s + c * sizeof(__m256i)));
+
+			eq = _mm256_and_si256(eq,
+					_mm256_cmpeq_epi16(_mm256_and_si256(t, q[c]), q[c]));
+		}
+
+		if (_mm256_movemask_epi8(eq) == -1)
+			SLICESETBIT(match, i);
+	}
+
+	matchTuplesFrom(sign, signLen, tuples, i, nTuples, tupleSize, match);
+}
+#endif
+
+#ifdef USE_AVX2_WITH_RUNTIME_CHECK
+static bool	haveAVX2 = false;
+#endif
+
+/*
+ * Check CPU features, called from _PG_init()
+ */
+void
+BloomInitMatch(void)
+{
+#ifdef USE_AVX2_WITH_RUNTIME_CHECK
+	__builtin_cpu_init();
+	haveAVX2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+/*
+ * Choose the best kernel for signature of signLen words supported by CPU.
+ * Every tuple is compared by whole chunks, so wider chunk pays off only if
+ * signature doesn't fit into narrower one: signatures up to 8 words,
+ * including the default of 5, take one 16-byte SSE2 chunk, and AVX2 would
+ * spend half of its 32-byte load on the next tuple.
+ */
+BloomMatchFunc
+BloomGetMatchFunc(int signLen)
+{
+	BloomMatchFunc	match = matchTuplesScalar;
+
+#ifdef __SSE2__
+	match = matchTuplesSSE2;
+#endif
+
+#ifdef USE_AVX2_WITH_RUNTIME_CHECK
+	if (haveAVX2 && signLen * sizeof(SignType) > 16)
+		match = matchTuplesAVX2;
+#endif
+
+	return match;
+}
@@ -5,10 +5,19 @@
 #include "access/itup.h"
 #include "access/xlog.h"
 #include "fmgr.h"
+#include "utils/hsearch.h"
 
 #define	BLOOM_HASH_PROC		1
 #define	BLLOMNProc			1
 
+/*
+ * Strategies, array opclasses support all of them and scalar ones only
+ * the first
+ */
+#define BLOOM_EQUAL_STRATEGY	1
+#define BLOOM_CONTAINS_STRATEGY	2	/* @>, signature of every element is set */
+#define BLOOM_OVERLAP_STRATEGY	3	/* &&, signature of any element is set */
+
 typedef struct BloomPageOpaqueData
 {
 	OffsetNumber	maxoff;
@@ -19,68 +28,139 @@ typedef BloomPageOpaqueData *BloomPageOpaque;
 
 #define BLOOM_META		(1<<0)
 #define BLOOM_DELETED	(2<<0)
+#define BLOOM_SLICED	(1<<2)
+#define BLOOM_SUMMARY	(1<<3)
+#define BLOOM_COMPACTING	(1<<4)	/* metapage: tuples could be stored twice */
 
 #define BloomPageGetOpaque(page) ( (BloomPageOpaque) PageGetSpecialPointer(page) )
 #define BloomPageGetMaxOffset(page) ( BloomPageGetOpaque(page)->maxoff )
 #define BloomPageIsMeta(page) ( BloomPageGetOpaque(page)->flags & BLOOM_META)
 #define BloomPageIsDeleted(page) ( BloomPageGetOpaque(page)->flags & BLOOM_DELETED)
+#define BloomPageIsSliced(page) ( BloomPageGetOpaque(page)->flags & BLOOM_SLICED)
+#define BloomPageHasSummary(page) ( BloomPageGetOpaque(page)->flags & BLOOM_SUMMARY)
+#define BloomPageIsCompacting(page) ( BloomPageGetOpaque(page)->flags & BLOOM_COMPACTING)
+/* OR of signatures of all page's tuples, placed just after opaque data */
+#define BloomPageGetSummary(page) \
+	( (SignType*)( ((char*)BloomPageGetOpaque(page)) + sizeof(BloomPageOpaqueData) ) )
 #define BloomPageSetDeleted(page)    ( BloomPageGetOpaque(page)->flags |= BLOOM_DELETED)
 #define BloomPageSetNonDeleted(page) ( BloomPageGetOpaque(page)->flags &= ~BLOOM_DELETED)
+#define BloomPageSetCompacting(page)   ( BloomPageGetOpaque(page)->flags |= BLOOM_COMPACTING)
+#define BloomPageClearCompacting(page) ( BloomPageGetOpaque(page)->flags &= ~BLOOM_COMPACTING)
 #define BloomPageGetData(page)		(  (BloomTuple*)PageGetContents(page) )
 
 #define BLOOM_METAPAGE_BLKNO  	(0)
 #define BLOOM_HEAD_BLKNO  		(1)
 
+#define BLOOM_MAX_LENGTH	(256)
+
 typedef struct BloomOptions 
 {
 	int32       vl_len_;	/* varlena header (do not touch directly!) */
 	int		bloomLength;	
 	int		bitSize[INDEX_MAX_KEYS];
+	bool	sliced;			/* store signatures in bit-sliced pages */
+	double	fpr;			/* target false positive rate, 0 - off */
+	bool	nulls;			/* sign NULLs by null-marker bits of column */
 } BloomOptions;
 
 
 
+/*
+ * Options are stored at the end of metapage and they could grow up to
+ * BLOOM_META_OPTS_SIZE bytes without moving anything else, which is
+ * checked by BloomInitMetapage() at compile time. Fields added
+ * to BloomOptions later are read as zero from older metapages, so zero
+ * should always mean the old behaviour.
+ */
+#define BLOOM_META_OPTS_SIZE	(256)
+
 typedef BlockNumber FreeBlockNumberArray[
 			MAXALIGN_DOWN(
 				BLCKSZ - 
 					SizeOfPageHeaderData - 
 					MAXALIGN(sizeof(BloomPageOpaqueData)) - 
 					/* header of BloomMetaPageData struct */
-					MAXALIGN(sizeof(uint16) * 2 + sizeof(uint32) + sizeof(BloomOptions)) 
+					MAXALIGN(sizeof(uint16) * 3 + sizeof(uint32)) -
+					BLOOM_META_OPTS_SIZE
 			) / sizeof(BlockNumber) 
 		];
 
+/*
+ * nStart, nEnd and notFullPage are not used anymore, free space is
+ * tracked in FSM. They are kept to keep place of options.
+ */
 typedef struct BloomMetaPageData
 {
 	uint32					magickNumber;
 	uint16					nStart;
 	uint16					nEnd;
-	BloomOptions			opts;
+	uint16					hashScheme;
 	FreeBlockNumberArray	notFullPage;
+	BloomOptions			opts;
 } BloomMetaPageData;
 
-#define BLOOM_MAGICK_NUMBER	(0xDBAC0DED)
+#define BLOOM_MAGICK_NUMBER	(0xDBAC0DEF)
+/* 
+ * Indexes created before hashScheme was introduced, their metapage
+ * is converted by initBloomState() 
+ */
+#define BLOOM_LEGACY_MAGICK_NUMBER	(0xDBAC0DED)
+
+/*
+ * Ways to map hash value of column into signature bits. Signatures already
+ * stored in index depend on it, so scheme is fixed at creation time.
+ */
+#define BLOOM_HASH_LIBC_RAND	(0)		/* srand()/rand(), platform dependent */
+#define BLOOM_HASH_DOUBLE		(1)		/* seeded double hashing */
+
+/*
+ * Hash procs of opclasses which signValue() computes inline, results
+ * are the same as of the functions themselves
+ */
+#define BLOOM_HASHFN_FMGR		(0)
+#define BLOOM_HASHFN_INT2		(1)		/* hashint2 */
+#define BLOOM_HASHFN_INT4		(2)		/* hashint4, also date */
+#define BLOOM_HASHFN_INT8		(3)		/* hashint8, timestamp_hash */
+#define BLOOM_HASHFN_CHAR		(4)		/* hashchar, used for bool */
+#define BLOOM_HASHFN_UUID		(5)		/* uuid_hash */
 
-#define BloomMetaBlockN		(sizeof(FreeBlockNumberArray) / sizeof(BlockNumber))
 #define BloomPageGetMeta(p) \
 	((BloomMetaPageData *) PageGetContents(p))
 
 typedef struct BloomState 
 {
 	FmgrInfo			hashFn[INDEX_MAX_KEYS];
-	BloomOptions		*opts; /* stored in rd_amcache and defined at creation time */
+	BloomOptions		*opts; /* optsData of this copy, defined at creation time */
+	uint16				hashScheme;
+	/* per-column seeds of BLOOM_HASH_DOUBLE scheme */
+	uint64				seed[INDEX_MAX_KEYS];
+	/* hash function known by signValue(), called without fmgr */
+	uint8				hashKind[INDEX_MAX_KEYS];
+	/* element type of array column, InvalidOid for scalar one */
+	Oid					elemType[INDEX_MAX_KEYS];
+	int16				elemLen[INDEX_MAX_KEYS];
+	bool				elemByVal[INDEX_MAX_KEYS];
+	char				elemAlign[INDEX_MAX_KEYS];
 	int32				nColumns;
 	/* 
 	 * sizeOfBloomTuple is index's specific, and it depends on
 	 * reloptions, so precompute it
 	 */
 	int32				sizeOfBloomTuple; 
+	/*
+	 * Bit-sliced page keeps up to sliceCapacity tuples: array of heap
+	 * pointers and then one bitmap of sliceSize bytes per signature bit
+	 */
+	int32				sliceCapacity;
+	int32				sliceSize;
+	/* number of tuples fitting on empty data page of either layout */
+	int32				pageCapacity;
+	BloomOptions		optsData;
 } BloomState;
 
 #define BloomPageGetFreeSpace(state, page) \
-	(BLCKSZ - MAXALIGN(SizeOfPageHeaderData) \
-		- BloomPageGetMaxOffset(page) * (state)->sizeOfBloomTuple \
-		- MAXALIGN(sizeof(BloomPageOpaqueData)))
+	(((PageHeader) (page))->pd_special - MAXALIGN(SizeOfPageHeaderData) \
+		- BloomPageGetMaxOffset(page) * (state)->sizeOfBloomTuple)
 
 /*
  * Tuples are very different from all other relations
@@ -93,6 +173,13 @@ typedef struct BloomTuple {
 } BloomTuple;
 #define BLOOMTUPLEHDRSZ	offsetof(BloomTuple, sign)
 
+/* storage for the longest tuple, to make tuples without palloc */
+typedef union BloomTupleBuffer
+{
+	BloomTuple	tuple;
+	char		data[BLOOMTUPLEHDRSZ + sizeof(SignType) * BLOOM_MAX_LENGTH];
+} BloomTupleBuffer;
+
 #define BITBYTE 	(8)
 #define BITSIGNTYPE	(BITBYTE * sizeof(SignType))
 #define GETWORD(x,i) ( *( (SignType*)(x) + (int)( (i) / BITSIGNTYPE ) ) )
@@ -101,21 +188,103 @@ typedef struct BloomTuple {
 #define SETBIT(x,i)   GETWORD(x,i) |=  ( 0x01 << ( (i) % BITSIGNTYPE ) )
 #define GETBIT(x,i) ( (GETWORD(x,i) >> ( (i) % BITSIGNTYPE )) & 0x01 )
 
+/*
+ * Bit-sliced pages
+ */
+typedef uint64	BloomSliceWord;
+
+#define BITSLICEWORD	(BITBYTE * sizeof(BloomSliceWord))
+#define BloomSliceGetHeapPtrs(page)	( (ItemPointerData*)PageGetContents(page) )
+#define BloomSliceGetSlice(state, page, nBit) \
+	( (BloomSliceWord*)( ((char*)PageGetContents(page)) + \
+		TYPEALIGN(sizeof(BloomSliceWord), sizeof(ItemPointerData) * (state)->sliceCapacity) + \
+		(nBit) * (state)->sliceSize ) )
+#define SLICEGETBIT(x,i) ( ((x)[(i) / BITSLICEWORD] >> ((i) % BITSLICEWORD)) & 0x01 )
+#define SLICESETBIT(x,i) ( (x)[(i) / BITSLICEWORD] |=  ((BloomSliceWord)0x01) << ((i) % BITSLICEWORD) )
+#define SLICECLRBIT(x,i) ( (x)[(i) / BITSLICEWORD] &= ~(((BloomSliceWord)0x01) << ((i) % BITSLICEWORD)) )
+
+#define BloomPageGetFreeTuples(state, page) \
+	( BloomPageIsSliced(page) ? \
+		(state)->sliceCapacity - BloomPageGetMaxOffset(page) : \
+		BloomPageGetFreeSpace(state, page) / (state)->sizeOfBloomTuple )
+
+/* FSM space of page with room for at least one tuple, one FSM category */
+#define BLOOM_FSM_MIN_SPACE	(BLCKSZ / 256)
+
+/*
+ * Kernel of blmatch.c: sets i-th bit of match if i-th of nTuples tuples
+ * contains sign
+ */
+typedef void (*BloomMatchFunc) (SignType *sign, int signLen, char *tuples,
+								int nTuples, int tupleSize, char *limit,
+								BloomSliceWord *match);
+
+/*
+ * Limit of query signatures made from array keys. If there are too many
+ * combinations of elements, rest of array keys are ignored: results are
+ * rechecked on heap anyway.
+ */
+#define MaxBloomQuerySigns	(1024)
+
 typedef struct BloomScanOpaqueData
 {
-	SignType	*sign;
+	SignType	*signs;		/* query signatures, NULL if not made yet */
+	int			nSigns;		/* tuple matches if it matches any of them */
+	int			**signBits;	/* positions of set bits, for bit-sliced pages */
+	int			*nSignBits;
 	BloomState	state;
+	BloomMatchFunc	matchTuples;	/* kernel for length of signature */
+	/* tuple at a time scan: matched heap pointers of pinned curBuffer */
+	Buffer		curBuffer;
+	BlockNumber	nextBlkno;
+	BlockNumber	prefetchBlkno;
+	BlockNumber	nScanPages;
+	ItemPointerData	*items;
+	int			nItems;
+	int			curItem;
+	bool		compacting;	/* index could have duplicates, see compactIndex() */
+	HTAB		*seenTids;	/* returned ones, if compacting */
+	/* copy of data pages for rescans, kept until the end of scan */
+	MemoryContext	scanCxt;
+	int			nScans;
+	char		*pages;
+	BlockNumber	nPages;		/* pages has nPages - BLOOM_HEAD_BLKNO pages */
+	bool		pagesDone;	/* copy is complete */
 } BloomScanOpaqueData;
 
+#define BloomScanGetCachedPage(so, blkno) \
+	( (Page) ((so)->pages + (Size) ((blkno) - BLOOM_HEAD_BLKNO) * BLCKSZ) )
+
 typedef BloomScanOpaqueData *BloomScanOpaque;
 
 /* blutils.c */
+extern BloomState *BloomGetState(Relation index);
 extern void initBloomState(BloomState *state, Relation index);
-extern void BloomInitMetabuffer(Buffer b, Relation index);
-extern void BloomInitBuffer(Buffer b, uint16 f);
+extern void BloomInitMetapage(Page page, Size pageSize, Relation index);
 extern void BloomInitPage(Page page, uint16 f, Size pageSize);
+extern void BloomInitDataPage(BloomState *state, Page page, Size pageSize);
+extern void BloomInitDataBuffer(BloomState *state, Buffer b);
+extern void BloomPageUpdateSummary(BloomState *state, Page p);
+extern Size BloomPageGetFsmSpace(BloomState *state, Page page);
+extern void BloomLogPage(Relation index, Buffer buffer);
 extern Buffer BloomNewBuffer(Relation index);
+extern bool BloomIsCompacting(Relation index);
+extern void BloomPrefetch(Relation index, BlockNumber *prefetchBlkno,
+							BlockNumber blkno, BlockNumber npages);
+extern int BloomSliceCapacity(int bloomLength, int32 *sliceSize);
 extern void signValue(BloomState *state, SignType *sign, Datum value, int attno);
-extern BloomTuple* BloomFormTuple(BloomState *state, ItemPointer iptr, Datum *values, bool *isnull);
+extern void signNull(BloomState *state, SignType *sign, int attno);
+extern void signArray(BloomState *state, SignType *sign, Datum value, int attno);
+extern double BloomArrayElements(Oid elemType, int32 width);
+extern void BloomFillTuple(BloomState *state, BloomTuple *res, ItemPointer iptr, 
+							Datum *values, bool *isnull);
 bool BloomPageAddItem(BloomState *state, Page p, BloomTuple *t);
+
+/* blinsert.c */
+extern void BloomInitInsertBatch(void);
+extern void BloomFlushInserts(Oid indexOid);
+
+/* blmatch.c */
+extern void BloomInitMatch(void);
+extern BloomMatchFunc BloomGetMatchFunc(int signLen);
 #endif
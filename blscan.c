@@ -5,11 +5,16 @@
 #include "miscadmin.h"
 #include "storage/bufmgr.h"
 #include "storage/lmgr.h"
+#include "utils/array.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
+#include "utils/tqual.h"
 
 #include "bloom.h"
 
+static void freeQuerySigns(BloomScanOpaque so);
+
 PG_FUNCTION_INFO_V1(blbeginscan);
 Datum       blbeginscan(PG_FUNCTION_ARGS);
 Datum
@@ -39,17 +44,24 @@ blrescan(PG_FUNCTION_ARGS)
 	if (so == NULL)
 	{
 		/* if called from blbeginscan */
-		so = (BloomScanOpaque) palloc(sizeof(BloomScanOpaqueData));
+		so = (BloomScanOpaque) palloc0(sizeof(BloomScanOpaqueData));
 		initBloomState(&so->state, scan->indexRelation);
+		so->matchTuples = BloomGetMatchFunc(so->state.opts->bloomLength);
+		so->scanCxt = CurrentMemoryContext;
 		scan->opaque = so;
 
 	}
 	else
 	{
-		if (so->sign)
-			pfree(so->sign);
+		freeQuerySigns(so);
+		if (BufferIsValid(so->curBuffer))
+			ReleaseBuffer(so->curBuffer);
+		if (so->seenTids)
+			hash_destroy(so->seenTids);
 	}
-	so->sign = NULL;
+	so->curBuffer = InvalidBuffer;
+	so->nItems = so->curItem = 0;
+	so->seenTids = NULL;
 
 	if (scankey && scan->numberOfKeys > 0)
 	{
@@ -69,9 +81,19 @@ blendscan(PG_FUNCTION_ARGS)
 	IndexScanDesc scan = (IndexScanDesc) PG_GETARG_POINTER(0);
 	BloomScanOpaque so = (BloomScanOpaque) scan->opaque;
 
-	if (so->sign)
-		pfree(so->sign);
-	so->sign = NULL;
+	freeQuerySigns(so);
+	if (BufferIsValid(so->curBuffer))
+		ReleaseBuffer(so->curBuffer);
+	so->curBuffer = InvalidBuffer;
+	if (so->items)
+		pfree(so->items);
+	so->items = NULL;
+	if (so->seenTids)
+		hash_destroy(so->seenTids);
+	so->seenTids = NULL;
+	if (so->pages)
+		pfree(so->pages);
+	so->pages = NULL;
 
 	PG_RETURN_VOID();
 }
@@ -94,6 +116,475 @@ blrestrpos(PG_FUNCTION_ARGS)
 	PG_RETURN_VOID();
 }
 
+#define MaxBloomMatchWords	(BLCKSZ / (sizeof(ItemPointerData) * BITSLICEWORD) + 1)
+
+/*
+ * Bit-sliced page: AND only slices of bits set in query signature, each
+ * word of result covers BITSLICEWORD tuples. Returns false if nothing
+ * matches.
+ */
+static bool
+matchSlicedPage(BloomState *state, Page page, int *signBits, int nSignBits,
+				BloomSliceWord *match)
+{
+	int				maxoff = BloomPageGetMaxOffset(page);
+	int				nWords = (maxoff + BITSLICEWORD - 1) / BITSLICEWORD;
+	int				i, w;
+
+	if (maxoff == 0)
+		return false;
+
+	for(w=0; w<nWords; w++)
+		match[w] = ~((BloomSliceWord)0);
+	if (maxoff % BITSLICEWORD)
+		match[nWords - 1] = (((BloomSliceWord)1) << (maxoff % BITSLICEWORD)) - 1;
+
+	for(i=0; i<nSignBits; i++)
+	{
+		BloomSliceWord	*slice = BloomSliceGetSlice(state, page, signBits[i]);
+		BloomSliceWord	any = 0;
+
+		for(w=0; w<nWords; w++)
+			any |= (match[w] &= slice[w]);
+
+		if (any == 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Add heap pointers of matched tuples into bitmap, i-th heap pointer is
+ * placed at heapPtrs + i * stride
+ */
+static int64
+addMatchedTuples(TIDBitmap *tbm, BloomSliceWord *match, int nTuples,
+					char *heapPtrs, int stride)
+{
+	int		nWords = (nTuples + BITSLICEWORD - 1) / BITSLICEWORD;
+	int64	ntids = 0;
+	int		i, w;
+
+	for(w=0; w<nWords; w++)
+	{
+		BloomSliceWord	m = match[w];
+
+		for(i = w * BITSLICEWORD; m; i++, m >>= 1)
+		{
+			if (m & 0x01)
+			{
+				tbm_add_tuples(tbm, (ItemPointer)(heapPtrs + i * stride), 1, true);
+				ntids++;
+			}
+		}
+	}
+
+	return ntids;
+}
+
+/*
+ * Page could be skipped if its summary signature doesn't contain query
+ */
+static bool
+pageCouldMatch(BloomState *state, Page page, SignType *sign)
+{
+	SignType	*summary;
+	int			i;
+
+	if (!BloomPageHasSummary(page))
+		return true;
+
+	summary = BloomPageGetSummary(page);
+	for(i=0; i<state->opts->bloomLength; i++)
+		if ((summary[i] & sign[i]) != sign[i])
+			return false;
+
+	return true;
+}
+
+/*
+ * Get not null elements of array key, returns their number. Elements of
+ * pass-by-reference type point into arr.
+ */
+static int
+keyElements(ArrayType *arr, Datum **elems)
+{
+	int16		elmlen;
+	bool		elmbyval;
+	char		elmalign;
+	bool		*nulls;
+	int			nElems,
+				nNotNull = 0,
+				e;
+
+	get_typlenbyvalalign(ARR_ELEMTYPE(arr), &elmlen, &elmbyval, &elmalign);
+	deconstruct_array(arr, ARR_ELEMTYPE(arr), elmlen, elmbyval, elmalign,
+					  elems, &nulls, &nElems);
+
+	for(e=0; e<nElems; e++)
+		if (!nulls[e])
+			(*elems)[nNotNull++] = (*elems)[e];
+
+	pfree(nulls);
+
+	return nNotNull;
+}
+
+/*
+ * Fill so->signs and so->nSigns: one signature for scalar keys, or one
+ * per combination of elements of array keys and of keys of overlap
+ * operator. Zero signatures means nothing could match, empty signature
+ * (no keys) matches everything.
+ */
+static void
+makeQuerySignsInternal(IndexScanDesc scan, BloomScanOpaque so)
+{
+	int			signLen = so->state.opts->bloomLength;
+	ScanKey		skey;
+	int			i, j, e;
+
+	so->signs = palloc0(sizeof(SignType) * signLen);
+	so->nSigns = 0;
+
+	/*
+	 * Assume, that Bloom-indexable operators are strict, so nothing could
+	 * be found by NULL key. IS NULL is checked by null-marker bits if index
+	 * has them. IS NOT NULL can't be checked: marker bits could be set by
+	 * other values.
+	 */
+	for(i=0, skey = scan->keyData; i<scan->numberOfKeys; i++, skey++)
+	{
+		int		attno = skey->sk_attno - 1;
+
+		if (skey->sk_flags & SK_SEARCHNULL)
+		{
+			if (so->state.opts->nulls)
+				signNull(&so->state, so->signs, attno);
+			continue;
+		}
+
+		if (skey->sk_flags & SK_SEARCHNOTNULL)
+			continue;
+
+		if (skey->sk_flags & SK_ISNULL)
+			return;
+
+		if (skey->sk_flags & SK_SEARCHARRAY)
+			continue;
+
+		if (!OidIsValid(so->state.elemType[attno]))
+			signValue(&so->state, so->signs, skey->sk_argument, attno);
+		/* array equal to or containing key has all its elements */
+		else if (skey->sk_strategy != BLOOM_OVERLAP_STRATEGY)
+			signArray(&so->state, so->signs, skey->sk_argument, attno);
+	}
+	so->nSigns = 1;
+
+	for(i=0, skey = scan->keyData; i<scan->numberOfKeys; i++, skey++)
+	{
+		int			attno = skey->sk_attno - 1;
+		ArrayType	*arr;
+		Datum		*elems;
+		int			nNotNull;
+		SignType	*signs;
+
+		/*
+		 * Every element of array key is a scalar key, and array overlapping
+		 * key has any of its elements. Array keys of array column are
+		 * ignored, heap recheck filters them.
+		 */
+		if (skey->sk_flags & (SK_SEARCHNULL | SK_SEARCHNOTNULL))
+			continue;
+
+		if (skey->sk_flags & SK_SEARCHARRAY)
+		{
+			if (OidIsValid(so->state.elemType[attno]))
+				continue;
+		}
+		else if (!OidIsValid(so->state.elemType[attno]) ||
+				 skey->sk_strategy != BLOOM_OVERLAP_STRATEGY)
+			continue;
+
+		/* NULL elements don't match anything too */
+		arr = DatumGetArrayTypeP(skey->sk_argument);
+		nNotNull = keyElements(arr, &elems);
+
+		if (nNotNull == 0)
+			so->nSigns = 0;
+		else if (so->nSigns * nNotNull <= MaxBloomQuerySigns)
+		{
+			signs = palloc(sizeof(SignType) * signLen * so->nSigns * nNotNull);
+			for(j=0; j<so->nSigns; j++)
+			{
+				for(e=0; e<nNotNull; e++)
+				{
+					SignType	*sign = signs + (j * nNotNull + e) * signLen;
+
+					memcpy(sign, so->signs + j * signLen, sizeof(SignType) * signLen);
+					signValue(&so->state, sign, elems[e], attno);
+				}
+			}
+
+			pfree(so->signs);
+			so->signs = signs;
+			so->nSigns *= nNotNull;
+		}
+
+		/* rescans of nestloop's inner side would pile them up in scan memory */
+		pfree(elems);
+		if ((Pointer) arr != DatumGetPointer(skey->sk_argument))
+			pfree(arr);
+
+		if (so->nSigns == 0)
+			return;
+	}
+}
+
+/*
+ * Make query signatures in memory of scan, for bit-sliced index also
+ * positions of their set bits
+ */
+static void
+makeQuerySigns(IndexScanDesc scan, BloomScanOpaque so)
+{
+	MemoryContext	oldCtx = MemoryContextSwitchTo(so->scanCxt);
+
+	makeQuerySignsInternal(scan, so);
+
+	if (so->state.opts->sliced && so->nSigns > 0)
+	{
+		int		nBits = so->state.opts->bloomLength * BITSIGNTYPE;
+		int		i, j;
+
+		/* positions of set bits, only their slices will be read */
+		so->signBits = palloc(sizeof(int*) * so->nSigns);
+		so->nSignBits = palloc0(sizeof(int) * so->nSigns);
+		for(j=0; j<so->nSigns; j++)
+		{
+			SignType	*sign = so->signs + j * so->state.opts->bloomLength;
+
+			so->signBits[j] = palloc(sizeof(int) * nBits);
+			for(i=0; i<nBits; i++)
+				if (GETBIT(sign, i))
+					so->signBits[j][so->nSignBits[j]++] = i;
+		}
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+}
+
+static void
+freeQuerySigns(BloomScanOpaque so)
+{
+	int		j;
+
+	if (so->signBits)
+	{
+		for(j=0; j<so->nSigns; j++)
+			pfree(so->signBits[j]);
+		pfree(so->signBits);
+		pfree(so->nSignBits);
+	}
+	so->signBits = NULL;
+	so->nSignBits = NULL;
+
+	if (so->signs)
+		pfree(so->signs);
+	so->signs = NULL;
+	so->nSigns = 0;
+}
+
+/*
+ * Match tuples of page against all query signatures, match gets OR of
+ * results for each tuple. Returns false if nothing could match.
+ */
+static bool
+matchPage(BloomScanOpaque so, Page page, char *pageEnd, BloomSliceWord *match)
+{
+	int				maxoff = BloomPageGetMaxOffset(page);
+	int				nWords = (maxoff + BITSLICEWORD - 1) / BITSLICEWORD;
+	int				signLen = so->state.opts->bloomLength;
+	BloomSliceWord	cur[MaxBloomMatchWords];
+	bool			found = false;
+	int				i, w;
+
+	for(i=0; i<so->nSigns; i++)
+	{
+		SignType		*sign = so->signs + i * signLen;
+		/* the first matched signature writes result directly */
+		BloomSliceWord	*res = found ? cur : match;
+
+		if (BloomPageIsSliced(page))
+		{
+			if (!matchSlicedPage(&so->state, page, so->signBits[i], so->nSignBits[i], res))
+				continue;
+		}
+		else
+		{
+			if (!pageCouldMatch(&so->state, page, sign))
+				continue;
+			so->matchTuples(sign, signLen, (char*)BloomPageGetData(page), maxoff,
+							so->state.sizeOfBloomTuple, pageEnd, res);
+		}
+
+		if (found)
+			for(w=0; w<nWords; w++)
+				match[w] |= cur[w];
+		found = true;
+	}
+
+	return found;
+}
+
+/*
+ * Copy heap pointers of matched tuples into items, returns their number
+ */
+static int
+collectMatchedTuples(BloomSliceWord *match, int nTuples, char *heapPtrs,
+						int stride, ItemPointer items)
+{
+	int		nWords = (nTuples + BITSLICEWORD - 1) / BITSLICEWORD;
+	int		nItems = 0;
+	int		i, w;
+
+	for(w=0; w<nWords; w++)
+	{
+		BloomSliceWord	m = match[w];
+
+		for(i = w * BITSLICEWORD; m; i++, m >>= 1)
+			if (m & 0x01)
+				items[nItems++] = *(ItemPointer)(heapPtrs + i * stride);
+	}
+
+	return nItems;
+}
+
+/*
+ * Crash in the middle of vacuum's compaction could leave moved tuples both
+ * on source and destination pages, until the next vacuum removes them, see
+ * compactIndex(). Meanwhile all returned heap pointers are remembered,
+ * and ones met again are dropped. Returns number of items left.
+ */
+static int
+skipDuplicates(BloomScanOpaque so, int nItems)
+{
+	int		n = 0,
+			i;
+
+	if (so->seenTids == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(ItemPointerData);
+		ctl.entrysize = sizeof(ItemPointerData);
+		ctl.hash = tag_hash;
+		ctl.hcxt = so->scanCxt;
+		so->seenTids = hash_create("Bloom returned heap pointers", 1024, &ctl,
+								   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	}
+
+	for(i=0; i<nItems; i++)
+	{
+		bool	found;
+
+		hash_search(so->seenTids, so->items + i, HASH_ENTER, &found);
+		if (!found)
+			so->items[n++] = so->items[i];
+	}
+
+	return n;
+}
+
+/*
+ * Tuple at a time scan: heap pointers matched on one page are returned
+ * one by one, and the next page is read only when they are over. So
+ * LIMIT or EXISTS stops reading of index early. Page is kept pinned
+ * while its pointers are returned, as nbtree does.
+ */
+PG_FUNCTION_INFO_V1(blgettuple);
+Datum       blgettuple(PG_FUNCTION_ARGS);
+Datum
+blgettuple(PG_FUNCTION_ARGS)
+{
+	IndexScanDesc 			scan = (IndexScanDesc) PG_GETARG_POINTER(0);
+	/* ScanDirection dir = (ScanDirection) PG_GETARG_INT32(1); */
+	BloomScanOpaque 		so = (BloomScanOpaque) scan->opaque;
+	Relation				index = scan->indexRelation;
+	BloomSliceWord			match[MaxBloomMatchWords];
+
+	if (so->signs == NULL)
+	{
+		makeQuerySigns(scan, so);
+
+		/* tuples inserted by our own statement should be found */
+		BloomFlushInserts(RelationGetRelid(index));
+
+		if (!RELATION_IS_LOCAL(index))
+			LockRelationForExtension(index, ShareLock);
+		so->nScanPages = RelationGetNumberOfBlocks(index);
+		if (!RELATION_IS_LOCAL(index))
+			UnlockRelationForExtension(index, ShareLock);
+
+		/* compaction can't start while we hold AccessShareLock */
+		so->compacting = BloomIsCompacting(index);
+
+		so->nextBlkno = so->prefetchBlkno = BLOOM_HEAD_BLKNO;
+		if (so->items == NULL)
+			so->items = MemoryContextAlloc(so->scanCxt,
+							sizeof(ItemPointerData) * MaxBloomMatchWords * BITSLICEWORD);
+	}
+
+	if (so->nSigns == 0)
+		PG_RETURN_BOOL(false);
+
+	for(;;)
+	{
+		Page	page;
+
+		if (so->curItem < so->nItems)
+		{
+			scan->xs_ctup.t_self = so->items[so->curItem++];
+			scan->xs_recheck = true;
+			PG_RETURN_BOOL(true);
+		}
+
+		if (BufferIsValid(so->curBuffer))
+			ReleaseBuffer(so->curBuffer);
+		so->curBuffer = InvalidBuffer;
+
+		if (so->nextBlkno >= so->nScanPages)
+			PG_RETURN_BOOL(false);
+
+		BloomPrefetch(index, &so->prefetchBlkno, so->nextBlkno, so->nScanPages);
+		so->curBuffer = ReadBuffer(index, so->nextBlkno);
+		so->nextBlkno++;
+
+		LockBuffer(so->curBuffer, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(so->curBuffer);
+
+		so->nItems = so->curItem = 0;
+		if (!BloomPageIsDeleted(page) &&
+			matchPage(so, page, ((char*)page) + BLCKSZ, match))
+		{
+			if (BloomPageIsSliced(page))
+				so->nItems = collectMatchedTuples(match, BloomPageGetMaxOffset(page),
+								(char*)BloomSliceGetHeapPtrs(page),
+								sizeof(ItemPointerData), so->items);
+			else
+				so->nItems = collectMatchedTuples(match, BloomPageGetMaxOffset(page),
+								((char*)BloomPageGetData(page)) + offsetof(BloomTuple, heapPtr),
+								so->state.sizeOfBloomTuple, so->items);
+			if (so->compacting)
+				so->nItems = skipDuplicates(so, so->nItems);
+		}
+
+		LockBuffer(so->curBuffer, BUFFER_LOCK_UNLOCK);
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
 PG_FUNCTION_INFO_V1(blgetbitmap);
 Datum       blgetbitmap(PG_FUNCTION_ARGS);
 Datum
@@ -103,89 +594,108 @@ blgetbitmap(PG_FUNCTION_ARGS)
 	TIDBitmap  				*tbm = (TIDBitmap *) PG_GETARG_POINTER(1);
 	int64					ntids = 0;
 	BlockNumber				blkno = BLOOM_HEAD_BLKNO,
+							prefetchBlkno = BLOOM_HEAD_BLKNO + 1,
 							npages;
-	int						i;
 	BufferAccessStrategy	bas;
 	BloomScanOpaque 		so = (BloomScanOpaque) scan->opaque;
+	BloomSliceWord			match[MaxBloomMatchWords];
 
-	PrefetchBuffer(scan->indexRelation, MAIN_FORKNUM, blkno);
-
-	if (so->sign == NULL && scan->numberOfKeys > 0)
-	{
-		/* new search without full scan */
-		ScanKey skey = scan->keyData;	
-
-		so->sign = palloc0( sizeof(SignType) * so->state.opts->bloomLength ); 
-		
-		for(i=0; i<scan->numberOfKeys;i++)
-		{
-			/*
-			 * Assume, that Bloom-indexable operators are strict, so nothing could
-		     * be found
-		     */
+	if (so->signs == NULL)
+		makeQuerySigns(scan, so);
 
-			if (skey->sk_flags & SK_ISNULL)
-			{
-				pfree(so->sign);
-				so->sign = NULL;
-				return 0;
-			}
+	if (so->nSigns == 0)
+		PG_RETURN_INT64(0);
 
-			signValue(&so->state, so->sign, skey->sk_argument, skey->sk_attno - 1);
+	/* tuples inserted by our own statement should be found */
+	BloomFlushInserts(RelationGetRelid(scan->indexRelation));
 
-			skey++;
-		}
+	if (so->pages && so->pagesDone)
+	{
+		npages = so->nPages;
+		bas = NULL;
 	}
+	else
+	{
+		PrefetchBuffer(scan->indexRelation, MAIN_FORKNUM, blkno);
+
+		if (!RELATION_IS_LOCAL(scan->indexRelation))
+			LockRelationForExtension(scan->indexRelation, ShareLock);
+		npages = RelationGetNumberOfBlocks(scan->indexRelation);
+		if (!RELATION_IS_LOCAL(scan->indexRelation))
+			UnlockRelationForExtension(scan->indexRelation, ShareLock);
+
+		/*
+		 * Rescan of inner side of nestloop reads the same index again for 
+		 * every outer row. Since the second scan keep copy of pages in 
+		 * memory if it fits into work_mem, following scans don't touch 
+		 * buffers at all. MVCC snapshot doesn't see tuples added later, 
+		 * so the copy is as good as index itself.
+		 */
+		if (so->nScans > 0 && npages > BLOOM_HEAD_BLKNO && 
+				IsMVCCSnapshot(scan->xs_snapshot) &&
+				(npages - BLOOM_HEAD_BLKNO) <= (work_mem * 1024L) / BLCKSZ)
+		{
+			so->pages = MemoryContextAlloc(so->scanCxt,
+										   (Size) (npages - BLOOM_HEAD_BLKNO) * BLCKSZ);
+			so->nPages = npages;
+		}
 
-	bas = GetAccessStrategy(BAS_BULKREAD);
-
-    if (!RELATION_IS_LOCAL(scan->indexRelation))
-		LockRelationForExtension(scan->indexRelation, ShareLock);
-	npages = RelationGetNumberOfBlocks(scan->indexRelation);
-    if (!RELATION_IS_LOCAL(scan->indexRelation))
-		UnlockRelationForExtension(scan->indexRelation, ShareLock);
+		/*
+		 * OR of conditions is a BitmapOr of scans of the same index, and each
+		 * of them reads all pages. Like heap's seqscan, use ring buffer only
+		 * for large index, so following scans find smaller one in cache.
+		 */
+		bas = (npages > NBuffers / 4) ? GetAccessStrategy(BAS_BULKREAD) : NULL;
+	}
+	so->nScans++;
 
 	for(blkno=BLOOM_HEAD_BLKNO; blkno < npages; blkno++)
 	{
-		Buffer 			buffer;
+		Buffer 			buffer = InvalidBuffer;
 		Page			page;
 
-		buffer = ReadBufferExtended(
-						scan->indexRelation, MAIN_FORKNUM,
-						blkno, RBM_NORMAL, bas);
-		if (blkno+1 < npages)
-			PrefetchBuffer(scan->indexRelation, MAIN_FORKNUM, blkno + 1);
-
-		LockBuffer(buffer, BUFFER_LOCK_SHARE);
-		page = BufferGetPage(buffer);
-
-		if (!BloomPageIsDeleted(page))
+		if (so->pages && so->pagesDone)
 		{
-			BloomTuple	*itup = BloomPageGetData(page);
-			BloomTuple   *itupEnd = (BloomTuple*)( ((char*)itup) + 
-								so->state.sizeOfBloomTuple * BloomPageGetMaxOffset(page));
+			page = BloomScanGetCachedPage(so, blkno);
+		}
+		else
+		{
+			BloomPrefetch(scan->indexRelation, &prefetchBlkno, blkno, npages);
+			buffer = ReadBufferExtended(
+							scan->indexRelation, MAIN_FORKNUM,
+							blkno, RBM_NORMAL, bas);
 
-			while(itup < itupEnd)
-			{
-				bool res = true;
+			LockBuffer(buffer, BUFFER_LOCK_SHARE);
+			page = BufferGetPage(buffer);
 
-				for(i=0; res && i<so->state.opts->bloomLength; i++)
-					if ( (itup->sign[i] & so->sign[i]) != so->sign[i] )
-						res = false;
-	
-				if (res)
-				{
-					tbm_add_tuples(tbm, &itup->heapPtr, 1, true);
-					ntids++;
-				}
+			if (so->pages)
+				memcpy(BloomScanGetCachedPage(so, blkno), page, BLCKSZ);
+		}
 
-				itup = (BloomTuple*)( ((char*)itup) + so->state.sizeOfBloomTuple );
-			}
+		if (BloomPageIsDeleted(page) ||
+			!matchPage(so, page, ((char*)page) + BLCKSZ, match))
+		{
+			/* nothing to do */
+		}
+		else if (BloomPageIsSliced(page))
+		{
+			ntids += addMatchedTuples(tbm, match, BloomPageGetMaxOffset(page),
+							(char*)BloomSliceGetHeapPtrs(page),
+							sizeof(ItemPointerData));
+		}
+		else
+		{
+			ntids += addMatchedTuples(tbm, match, BloomPageGetMaxOffset(page),
+							((char*)BloomPageGetData(page)) + offsetof(BloomTuple, heapPtr),
+							so->state.sizeOfBloomTuple);
 		}
 
-		UnlockReleaseBuffer(buffer);
+		if (BufferIsValid(buffer))
+			UnlockReleaseBuffer(buffer);
 		CHECK_FOR_INTERRUPTS();
 	}
+	if (so->pages)
+		so->pagesDone = true;
 	FreeAccessStrategy(bas);
 
 	PG_RETURN_INT64(ntids);
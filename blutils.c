@@ -1,12 +1,23 @@
 #include "postgres.h"
 
+#include <math.h>
+
 #include "access/genam.h"
+#include "access/hash.h"
+#include "access/heapam.h"
 #include "catalog/index.h"
+#include "catalog/pg_statistic.h"
 #include "storage/lmgr.h"
 #include "miscadmin.h"
 #include "storage/bufmgr.h"
 #include "storage/indexfsm.h"
+#include "utils/array.h"
 #include "utils/memutils.h"
+#include "utils/fmgroids.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+#include "utils/uuid.h"
 #include "access/reloptions.h"
 #include "storage/freespace.h"
 #include "storage/indexfsm.h"
@@ -14,10 +25,113 @@
 #include "bloom.h"
 
 
-void 
-initBloomState(BloomState *state, Relation index)
+/*
+ * Metapage of indexes created before BLOOM_MAGICK_NUMBER, only options are
+ * interesting
+ */
+typedef struct BloomLegacyMetaPageData
+{
+	uint32		magickNumber;
+	uint16		nStart;
+	uint16		nEnd;
+	int32		vl_len_;
+	int			bloomLength;
+	int			bitSize[INDEX_MAX_KEYS];
+} BloomLegacyMetaPageData;
+
+/*
+ * Rewrite legacy metapage in current layout. Signatures are kept as is, so
+ * legacy hash scheme is remembered. Pages with free space are found by
+ * next vacuum.
+ */
+static void
+BloomConvertLegacyMetapage(Page page)
+{
+	BloomLegacyMetaPageData	legacy;
+	BloomMetaPageData		*meta = BloomPageGetMeta(page);
+
+	memcpy(&legacy, meta, sizeof(legacy));
+
+	memset(meta, 0, sizeof(BloomMetaPageData));
+	meta->magickNumber = BLOOM_MAGICK_NUMBER;
+	meta->hashScheme = BLOOM_HASH_LIBC_RAND;
+	meta->nStart = meta->nEnd = 0;
+	SET_VARSIZE(&meta->opts, sizeof(BloomOptions));
+	meta->opts.bloomLength = legacy.bloomLength;
+	memcpy(meta->opts.bitSize, legacy.bitSize, sizeof(legacy.bitSize));
+}
+
+/*
+ * Every change of index page is WAL-logged as full image of the page.
+ * Redo of such record is done by core (XLOG_HEAP_NEWPAGE), contrib module
+ * can't have its own resource manager. Should be called in critical
+ * section after MarkBufferDirty().
+ */
+void
+BloomLogPage(Relation index, Buffer buffer)
 {
-	int	i;
+	if (RelationNeedsWAL(index))
+		log_newpage(&index->rd_node, MAIN_FORKNUM,
+					BufferGetBlockNumber(buffer), BufferGetPage(buffer));
+}
+
+static uint64
+bloomMix64(uint64 x)
+{
+	/* finalizer of MurmurHash3 */
+	x ^= x >> 33;
+	x *= UINT64CONST(0xff51afd7ed558ccd);
+	x ^= x >> 33;
+	x *= UINT64CONST(0xc4ceb9fe1a85ec53);
+	x ^= x >> 33;
+
+	return x;
+}
+
+static uint8
+bloomHashKind(Oid hashProc)
+{
+	switch(hashProc)
+	{
+		case F_HASHINT2:
+			return BLOOM_HASHFN_INT2;
+		case F_HASHINT4:
+			return BLOOM_HASHFN_INT4;
+		case F_HASHINT8:
+			return BLOOM_HASHFN_INT8;
+#ifdef HAVE_INT64_TIMESTAMP
+		case F_TIMESTAMP_HASH:
+			return BLOOM_HASHFN_INT8;
+#endif
+		case F_HASHCHAR:
+			return BLOOM_HASHFN_CHAR;
+		case F_UUID_HASH:
+			return BLOOM_HASHFN_UUID;
+		default:
+			return BLOOM_HASHFN_FMGR;
+	}
+}
+
+/*
+ * Returns BloomState ready to use, it's kept in rd_amcache and lives until
+ * relcache invalidation of index. Relcache frees rd_amcache chunk, but
+ * keeps rd_indexcxt of index, so everything is allocated in the only
+ * chunk: options are in the state itself and copies made by
+ * initBloomState() point to their own options.
+ */
+BloomState *
+BloomGetState(Relation index)
+{
+	BloomState			*state;
+	Buffer				buffer;
+	BloomMetaPageData	*meta;
+	Page				copy = NULL;
+	int					i;
+
+	if (index->rd_amcache)
+		return (BloomState*)index->rd_amcache;
+
+	state = MemoryContextAllocZero(index->rd_indexcxt, sizeof(BloomState));
 
 	state->nColumns = index->rd_att->natts;
 
@@ -25,42 +139,115 @@ initBloomState(BloomState *state, Relation index)
 	{
 		fmgr_info_copy(&(state->hashFn[i]),
 						index_getprocinfo(index, i + 1, BLOOM_HASH_PROC),
-						CurrentMemoryContext);
+						index->rd_indexcxt);
+		/* different columns should not map equal values into equal bits */
+		state->seed[i] = bloomMix64(UINT64CONST(0x9E3779B97F4A7C15) * (i + 1));
+		state->hashKind[i] = bloomHashKind(state->hashFn[i].fn_oid);
+		/* array opclasses are defined for array type and hash its elements */
+		state->elemType[i] = get_element_type(index->rd_opcintype[i]);
+		if (OidIsValid(state->elemType[i]))
+			get_typlenbyvalalign(state->elemType[i], &state->elemLen[i],
+								 &state->elemByVal[i], &state->elemAlign[i]);
 	}
 
-	if (!index->rd_amcache)
+	buffer = ReadBuffer(index, BLOOM_METAPAGE_BLKNO);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+
+	if (!BloomPageIsMeta(BufferGetPage(buffer)))
+		elog(ERROR,"Relation is not a bloom index");
+	meta = BloomPageGetMeta(BufferGetPage(buffer));
+
+	if (meta->magickNumber == BLOOM_LEGACY_MAGICK_NUMBER && RecoveryInProgress())
 	{
-		Buffer				buffer;
-		BloomMetaPageData	*meta;
-		BloomOptions		*opts;
+		/* standby can't write, so convert a private copy */
+		copy = palloc(BLCKSZ);
+		memcpy(copy, BufferGetPage(buffer), BLCKSZ);
+		BloomConvertLegacyMetapage(copy);
+		meta = BloomPageGetMeta(copy);
+	}
+	else if (meta->magickNumber == BLOOM_LEGACY_MAGICK_NUMBER)
+	{
+		LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
 
-		opts = MemoryContextAlloc(index->rd_indexcxt, sizeof(BloomOptions));
+		/* somebody could convert it while we were unlocked */
+		if (meta->magickNumber == BLOOM_LEGACY_MAGICK_NUMBER)
+		{
+			START_CRIT_SECTION();
+			BloomConvertLegacyMetapage(BufferGetPage(buffer));
+			MarkBufferDirty(buffer);
+			BloomLogPage(index, buffer);
+			END_CRIT_SECTION();
+		}
+	}
 
-		buffer = ReadBuffer(index, BLOOM_METAPAGE_BLKNO);
-		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	if (meta->magickNumber != BLOOM_MAGICK_NUMBER)
+		elog(ERROR,"Relation is not a bloom index");
 
-		if (!BloomPageIsMeta(BufferGetPage(buffer)))
-			elog(ERROR,"Relation is not a bloom index");
-		meta = BloomPageGetMeta(BufferGetPage(buffer));
+	state->hashScheme = meta->hashScheme;
+	state->optsData = meta->opts;
 
-		if (meta->magickNumber != BLOOM_MAGICK_NUMBER)
-			elog(ERROR,"Relation is not a bloom index");
+	UnlockReleaseBuffer(buffer);
+	if (copy)
+		pfree(copy);
 
-		*opts = meta->opts;
+	state->opts = &state->optsData;
+	state->sizeOfBloomTuple = BLOOMTUPLEHDRSZ + sizeof(SignType) * state->opts->bloomLength; 
+	state->sliceCapacity = BloomSliceCapacity(state->opts->bloomLength, &state->sliceSize);
+	if (state->opts->sliced)
+		state->pageCapacity = state->sliceCapacity;
+	else
+		state->pageCapacity = (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) -
+								MAXALIGN(sizeof(BloomPageOpaqueData) +
+										 sizeof(SignType) * state->opts->bloomLength)) /
+								state->sizeOfBloomTuple;
+
+	index->rd_amcache = (void*)state;
+
+	return state;
+}
 
-		UnlockReleaseBuffer(buffer);
+void 
+initBloomState(BloomState *state, Relation index)
+{
+	memcpy(state, BloomGetState(index), sizeof(BloomState));
+	state->opts = &state->optsData;
+}
+
+/*
+ * Returns number of tuples which fit on bit-sliced page with given length
+ * of signature, zero if even one doesn't fit.
+ */
+int
+BloomSliceCapacity(int bloomLength, int32 *sliceSize)
+{
+	Size	avail = BLCKSZ - MAXALIGN(SizeOfPageHeaderData) 
+						- MAXALIGN(sizeof(BloomPageOpaqueData));
+	int		nBits = bloomLength * BITSIGNTYPE;
+	int		capacity;
+
+	/* bit-sliced tuple can't be smaller than tuple in common layout */
+	for(capacity = avail / (BLOOMTUPLEHDRSZ + sizeof(SignType) * bloomLength);
+		capacity > 0; capacity--)
+	{
+		*sliceSize = sizeof(BloomSliceWord) * 
+						((capacity + BITSLICEWORD - 1) / BITSLICEWORD);
 
-		index->rd_amcache = (void*)opts;
+		if (TYPEALIGN(sizeof(BloomSliceWord), sizeof(ItemPointerData) * capacity) +
+				nBits * (*sliceSize) <= avail)
+			break;
 	}
 
-	state->opts = (BloomOptions*)index->rd_amcache;
-	state->sizeOfBloomTuple = BLOOMTUPLEHDRSZ + sizeof(SignType) * state->opts->bloomLength; 
+	return capacity;
 }
 
-void
-signValue(BloomState *state, SignType *sign, Datum value, int attno)
+/*
+ * Original scheme: bits are produced by libc's rand(), so they depend on
+ * platform and touch global state of generator.
+ */
+static void
+signHashLibcRand(BloomState *state, SignType *sign, uint32 hashVal, int attno)
 {
-	uint32		hashVal;
 	int 		nBit, j;
 
 	/*
@@ -75,10 +262,6 @@ signValue(BloomState *state, SignType *sign, Datum value, int attno)
 	* in different columns will be mapped into different bits because
 	* of step above
 	*/
-	hashVal = DatumGetInt32(FunctionCall1(
-								&state->hashFn[attno],
-								value
-			 	));
 	srand(hashVal ^ rand());
 
 	for(j=0; j<state->opts->bitSize[attno]; j++)
@@ -89,12 +272,146 @@ signValue(BloomState *state, SignType *sign, Datum value, int attno)
 	}
 }
 
-BloomTuple*
-BloomFormTuple(BloomState *state, ItemPointer iptr, Datum *values, bool *isnull)
+/*
+ * Enhanced double hashing (Dillinger & Manolios): 64-bit mix of hash value
+ * and column's seed gives start position and step, j-th bit is
+ * h1 + j * h2 + j * (j - 1) / 2. Only two modulo per value.
+ */
+static void
+signBitsDouble(BloomState *state, SignType *sign, uint64 h, int attno)
+{
+	uint32		nBits = state->opts->bloomLength * BITSIGNTYPE;
+	uint32		nBit = ((uint32) h) % nBits;
+	uint32		step = ((uint32) (h >> 32)) % nBits;
+	int 		j;
+
+	for(j=0; j<state->opts->bitSize[attno]; j++)
+	{
+		SETBIT(sign, nBit);
+
+		nBit += step;
+		if (nBit >= nBits)
+			nBit -= nBits;
+		step++;
+		if (step >= nBits)
+			step -= nBits;
+	}
+}
+
+static void
+signHashDouble(BloomState *state, SignType *sign, uint32 hashVal, int attno)
+{
+	signBitsDouble(state, sign, bloomMix64(state->seed[attno] ^ (uint64) hashVal), attno);
+}
+
+/*
+ * Null-marker of column: the same number of bits as of value, taken from
+ * column's seed with high half inverted, so no 32-bit hash value of the
+ * column gives the same bits. Option nulls is available only for indexes
+ * made with BLOOM_HASH_DOUBLE scheme.
+ */
+void
+signNull(BloomState *state, SignType *sign, int attno)
+{
+	signBitsDouble(state, sign,
+				   bloomMix64(state->seed[attno] ^ UINT64CONST(0xFFFFFFFF00000000)),
+				   attno);
+}
+
+void
+signValue(BloomState *state, SignType *sign, Datum value, int attno)
+{
+	uint32		hashVal;
+	int64		val;
+
+	/* fmgr call costs more than hashing of fixed-width value itself */
+	switch(state->hashKind[attno])
+	{
+		case BLOOM_HASHFN_INT2:
+			hashVal = DatumGetUInt32(hash_uint32((int32) DatumGetInt16(value)));
+			break;
+		case BLOOM_HASHFN_INT4:
+			hashVal = DatumGetUInt32(hash_uint32(DatumGetInt32(value)));
+			break;
+		case BLOOM_HASHFN_INT8:
+			/* the same as hashint8() */
+			val = DatumGetInt64(value);
+			hashVal = (uint32) val;
+			hashVal ^= (val >= 0) ? (uint32) (val >> 32) : ~(uint32) (val >> 32);
+			hashVal = DatumGetUInt32(hash_uint32(hashVal));
+			break;
+		case BLOOM_HASHFN_CHAR:
+			hashVal = DatumGetUInt32(hash_uint32((int32) DatumGetChar(value)));
+			break;
+		case BLOOM_HASHFN_UUID:
+			hashVal = DatumGetUInt32(hash_any(DatumGetUUIDP(value)->data, UUID_LEN));
+			break;
+		default:
+			hashVal = DatumGetInt32(FunctionCall1(
+										&state->hashFn[attno],
+										value
+					 	));
+			break;
+	}
+
+	if (state->hashScheme == BLOOM_HASH_LIBC_RAND)
+		signHashLibcRand(state, sign, hashVal, attno);
+	else
+		signHashDouble(state, sign, hashVal, attno);
+}
+
+/*
+ * Array is signed by all its not null elements, so signature of array
+ * contains signatures of all its subsets
+ */
+void
+signArray(BloomState *state, SignType *sign, Datum value, int attno)
+{
+	ArrayType	*arr = DatumGetArrayTypeP(value);
+	Datum		*elems;
+	bool		*nulls;
+	int			nElems, e;
+
+	deconstruct_array(arr, state->elemType[attno], state->elemLen[attno],
+					  state->elemByVal[attno], state->elemAlign[attno],
+					  &elems, &nulls, &nElems);
+
+	for(e=0; e<nElems; e++)
+		if (!nulls[e])
+			signValue(state, sign, elems[e], attno);
+
+	pfree(elems);
+	pfree(nulls);
+	if ((Pointer) arr != DatumGetPointer(value))
+		pfree(arr);
+}
+
+/*
+ * Rough average number of elements of array column by average width of its
+ * values, the only statistics available for it. Returns 1 if width is
+ * unknown.
+ */
+double
+BloomArrayElements(Oid elemType, int32 width)
+{
+	int32	elemWidth = get_typavgwidth(elemType, -1);
+
+	if (width <= 0 || elemWidth <= 0)
+		return 1.0;
+
+	return Max((double) (width - ARR_OVERHEAD_NONULLS(1)) / elemWidth, 1.0);
+}
+
+/*
+ * Make tuple in caller's storage of sizeOfBloomTuple bytes
+ */
+void
+BloomFillTuple(BloomState *state, BloomTuple *res, ItemPointer iptr, 
+				Datum *values, bool *isnull)
 {
 	int 		i;
-	BloomTuple	*res = palloc0(state->sizeOfBloomTuple);
 
+	memset(res, 0, state->sizeOfBloomTuple);
 	res->heapPtr = *iptr;
 
     /*
@@ -103,16 +420,20 @@ BloomFormTuple(BloomState *state, ItemPointer iptr, Datum *values, bool *isnull)
 	for(i=0; i<state->nColumns; i++)
 	{
 		/*
-		 * skip nulls
+		 * skip nulls, or mark them if index searches them
 		 */
 		if ( isnull[i] )
+		{
+			if (state->opts->nulls)
+				signNull(state, res->sign, i);
 			continue;
+		}
 
-		signValue(state, res->sign, values[i], i);
-
+		if (OidIsValid(state->elemType[i]))
+			signArray(state, res->sign, values[i], i);
+		else
+			signValue(state, res->sign, values[i], i);
 	}
-
-	return res;
 }
 
 bool
@@ -121,22 +442,69 @@ BloomPageAddItem(BloomState *state, Page p, BloomTuple *t)
 	BloomTuple		*pagePtr;
 	BloomPageOpaque	opaque;
 
+	opaque = BloomPageGetOpaque(p);
+
+	if (BloomPageIsSliced(p))
+	{
+		int		i;
+
+		if (opaque->maxoff >= state->sliceCapacity)
+			return false;
+
+		BloomSliceGetHeapPtrs(p)[opaque->maxoff] = t->heapPtr;
+		for(i=0; i<state->opts->bloomLength * BITSIGNTYPE; i++)
+			if (GETBIT(t->sign, i))
+				SLICESETBIT(BloomSliceGetSlice(state, p, i), opaque->maxoff);
+		opaque->maxoff++;
+
+		return true;
+	}
+
 	if (BloomPageGetFreeSpace(state, p) < state->sizeOfBloomTuple)
 		return false;
 
-	opaque = BloomPageGetOpaque(p);
 	pagePtr = BloomPageGetData(p);
 	memcpy(((char*)pagePtr) + opaque->maxoff * state->sizeOfBloomTuple, 
 				t, state->sizeOfBloomTuple);
 	opaque->maxoff++;
 
+	if (BloomPageHasSummary(p))
+	{
+		SignType	*summary = BloomPageGetSummary(p);
+		int			i;
+
+		for(i=0; i<state->opts->bloomLength; i++)
+			summary[i] |= t->sign[i];
+	}
+
 	return true;
 }
 
+/*
+ * Free space of page to be recorded in FSM: room for its free tuples,
+ * but less than half of page, so GetFreeIndexPage() finds only deleted
+ * pages. Bit-sliced page counts tuples of common layout. FSM rounds space
+ * down, so room for even one tuple is at least BLOOM_FSM_MIN_SPACE.
+ */
+Size
+BloomPageGetFsmSpace(BloomState *state, Page page)
+{
+	Size	space;
+
+	if (BloomPageIsDeleted(page))
+		return BLCKSZ - 1;
+
+	space = (Size) BloomPageGetFreeTuples(state, page) * state->sizeOfBloomTuple;
+	if (space > 0)
+		space = Max(space, BLOOM_FSM_MIN_SPACE);
+
+	return Min(space, BLCKSZ / 2 - 1);
+}
+
 /*
  * Allocate a new page (either by recycling, or by extending the index file)
  * The returned buffer is already pinned and exclusive-locked
- * Caller is responsible for initializing the page by calling BloomInitBuffer
+ * Caller is responsible for initializing the page by calling BloomInitDataBuffer
  */
 
 Buffer
@@ -190,25 +558,110 @@ BloomNewBuffer(Relation index)
 	return buffer;
 }
 
-void
-BloomInitBuffer(Buffer b, uint16 f)
+/*
+ * Whether compaction of index was interrupted by crash and some tuples
+ * could be stored twice, see compactIndex()
+ */
+bool
+BloomIsCompacting(Relation index)
 {
-    BloomInitPage(BufferGetPage(b), f, BufferGetPageSize(b));
+	Buffer	buffer;
+	bool	res;
+
+	buffer = ReadBuffer(index, BLOOM_METAPAGE_BLKNO);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	res = BloomPageIsCompacting(BufferGetPage(buffer)) != 0;
+	UnlockReleaseBuffer(buffer);
+
+	return res;
 }
 
+/*
+ * Sequential passes over index read pages while CPU checks signatures of
+ * current one: keep up to effective_io_concurrency (at least one) pages
+ * after blkno being prefetched. *prefetchBlkno is the first page not
+ * requested yet.
+ */
 void
-BloomInitPage(Page page, uint16 f, Size pageSize)
+BloomPrefetch(Relation index, BlockNumber *prefetchBlkno,
+				BlockNumber blkno, BlockNumber npages)
+{
+	BlockNumber	until = blkno + Max(target_prefetch_pages, 1);
+
+	if (*prefetchBlkno <= blkno)
+		*prefetchBlkno = blkno + 1;
+
+	while(*prefetchBlkno <= until && *prefetchBlkno < npages)
+	{
+		PrefetchBuffer(index, MAIN_FORKNUM, *prefetchBlkno);
+		(*prefetchBlkno)++;
+	}
+}
+
+static void
+initPage(Page page, uint16 f, Size pageSize, Size specialSize)
 {
     BloomPageOpaque opaque;
 	 
-	PageInit(page, pageSize, sizeof(BloomPageOpaqueData));
+	PageInit(page, pageSize, specialSize);
 		  
 	opaque = BloomPageGetOpaque(page);
-	memset(opaque, 0, sizeof(BloomPageOpaqueData));
+	memset(opaque, 0, specialSize);
 	opaque->maxoff = 0;
 	opaque->flags = f;
 }
 
+void
+BloomInitPage(Page page, uint16 f, Size pageSize)
+{
+	initPage(page, f, pageSize, sizeof(BloomPageOpaqueData));
+}
+
+/*
+ * Init page to store tuples in layout of index. Common pages keep
+ * summary signature (OR of all tuples) after opaque data, bit-sliced pages
+ * don't need it because empty slice skips page even faster.
+ */
+void
+BloomInitDataPage(BloomState *state, Page page, Size pageSize)
+{
+	if (state->opts->sliced)
+		initPage(page, BLOOM_SLICED, pageSize, sizeof(BloomPageOpaqueData));
+	else
+		initPage(page, BLOOM_SUMMARY, pageSize, 
+					sizeof(BloomPageOpaqueData) + 
+					sizeof(SignType) * state->opts->bloomLength);
+}
+
+void
+BloomInitDataBuffer(BloomState *state, Buffer b)
+{
+	BloomInitDataPage(state, BufferGetPage(b), BufferGetPageSize(b));
+}
+
+/*
+ * Recalculate summary signature of common page after removing tuples
+ */
+void
+BloomPageUpdateSummary(BloomState *state, Page p)
+{
+	SignType	*summary = BloomPageGetSummary(p);
+	char		*itup = (char*)BloomPageGetData(p);
+	int			i, j;
+
+	if (!BloomPageHasSummary(p))
+		return;
+
+	memset(summary, 0, sizeof(SignType) * state->opts->bloomLength);
+	for(i=0; i<BloomPageGetMaxOffset(p); i++)
+	{
+		SignType	*sign = ((BloomTuple*)(itup + i * state->sizeOfBloomTuple))->sign;
+
+		for(j=0; j<state->opts->bloomLength; j++)
+			summary[j] |= sign[j];
+	}
+}
+
 
 static BloomOptions*
 makeDefaultBloomOptions(BloomOptions *opts)
@@ -228,17 +681,86 @@ makeDefaultBloomOptions(BloomOptions *opts)
 	return opts;
 }
 
+/*
+ * Choose length and bits per column by target false positive rate of
+ * query by one column. For signature of m bits filled by keys with k
+ * bits each, the rate is minimal when k = -log2(fpr) and
+ * m = keys * k / ln(2). NULLs don't set bits, so every column counts as
+ * its not null fraction of a key (plus null fraction with null-markers),
+ * and array column as the average number of its elements. Column with the only distinct value
+ * can't help to filter anything, it gets one bit. Statistics come from
+ * the last ANALYZE of the table, without them columns are assumed to be
+ * not null and distinct.
+ */
+static void
+sizeBloomOptions(Relation index, BloomOptions *opts)
+{
+	int		k = (int) ceil(-log(opts->fpr) / log(2.0));
+	double	nBits = 0.0;
+	int32	sliceSize;
+	int		i;
+
+	k = Max(k, 1);
+	k = Min(k, 2048);
+
+	for(i=0; i<index->rd_att->natts; i++)
+	{
+		AttrNumber	attnum = index->rd_index->indkey.values[i];
+		HeapTuple	tuple = NULL;
+		Oid			elemType = get_element_type(index->rd_opcintype[i]);
+		double		nullfrac = 0.0,
+					ndistinct = 0.0,
+					nElems = 1.0;
+
+		/* expression columns have no statistics */
+		if (attnum != 0)
+			tuple = SearchSysCache3(STATRELATTINH,
+									ObjectIdGetDatum(index->rd_index->indrelid),
+									Int16GetDatum(attnum),
+									BoolGetDatum(false));
+		if (HeapTupleIsValid(tuple))
+		{
+			nullfrac = ((Form_pg_statistic) GETSTRUCT(tuple))->stanullfrac;
+			ndistinct = ((Form_pg_statistic) GETSTRUCT(tuple))->stadistinct;
+			if (OidIsValid(elemType))
+				nElems = BloomArrayElements(elemType,
+								((Form_pg_statistic) GETSTRUCT(tuple))->stawidth);
+			ReleaseSysCache(tuple);
+		}
+
+		opts->bitSize[i] = (ndistinct == 1.0) ? 1 : k;
+		nBits += opts->bitSize[i] * ((1.0 - nullfrac) * nElems +
+									 (opts->nulls ? nullfrac : 0.0));
+	}
+
+	nBits /= log(2.0);
+	opts->bloomLength = (int) ceil(nBits / BITSIGNTYPE);
+	opts->bloomLength = Max(opts->bloomLength, 1);
+	opts->bloomLength = Min(opts->bloomLength, BLOOM_MAX_LENGTH);
+
+	if (opts->sliced)
+		while(opts->bloomLength > 1 &&
+				BloomSliceCapacity(opts->bloomLength, &sliceSize) == 0)
+			opts->bloomLength--;
+}
+
 void
-BloomInitMetabuffer(Buffer b, Relation index)
+BloomInitMetapage(Page page, Size pageSize, Relation index)
 {
 	BloomMetaPageData	*metadata;
-	Page				page = BufferGetPage(b);
 
-	BloomInitPage(page, BLOOM_META, BufferGetPageSize(b));
+	/* options can't grow into the rest of metapage */
+	StaticAssertStmt(sizeof(BloomOptions) <= BLOOM_META_OPTS_SIZE,
+					 "BloomOptions does not fit into BLOOM_META_OPTS_SIZE");
+
+	BloomInitPage(page, BLOOM_META, pageSize);
 	metadata = BloomPageGetMeta(page);
 	memset(metadata, 0, sizeof(BloomMetaPageData));
 	metadata->magickNumber = BLOOM_MAGICK_NUMBER;
+	metadata->hashScheme = BLOOM_HASH_DOUBLE;
 	metadata->opts = *makeDefaultBloomOptions((BloomOptions*)index->rd_options);
+	if (metadata->opts.fpr > 0.0)
+		sizeBloomOptions(index, &metadata->opts);
 }
 
 static relopt_kind bloom_kind = 0;
@@ -252,8 +774,11 @@ _PG_init(void)
 
 	bloom_kind = add_reloption_kind();
 
+	BloomInitMatch();
+	BloomInitInsertBatch();
+
 	add_int_reloption(bloom_kind, "length", "Length of signature in uint16 type",
-						5, 1, 256);
+						5, 1, BLOOM_MAX_LENGTH);
 
 	for(i=0;i<INDEX_MAX_KEYS;i++)
 	{
@@ -261,6 +786,16 @@ _PG_init(void)
 		add_int_reloption(bloom_kind, buf, "Number of bits for corresponding column",
 								2, 1, 2048);
 	}
+
+	add_bool_reloption(bloom_kind, "sliced", "Store signatures in bit-sliced pages",
+						false);
+
+	add_real_reloption(bloom_kind, "fpr", 
+						"Target false positive rate, length and colN are chosen by it",
+						0.0, 0.0, 1.0);
+
+	add_bool_reloption(bloom_kind, "nulls", "Sign NULLs to support IS NULL search",
+						false);
 }
 
 PG_FUNCTION_INFO_V1(bloptions);
@@ -273,7 +808,7 @@ bloptions(PG_FUNCTION_ARGS)
 	relopt_value 		*options;
 	int					numoptions;
 	BloomOptions		*rdopts;
-	relopt_parse_elt 	tab[INDEX_MAX_KEYS+1];
+	relopt_parse_elt 	tab[INDEX_MAX_KEYS+4];
 	int 				i;
 	char				buf[16];
 
@@ -289,12 +824,35 @@ bloptions(PG_FUNCTION_ARGS)
 		tab[i+1].offset = offsetof(BloomOptions, bitSize[i]);
 	}
 
+	tab[INDEX_MAX_KEYS+1].optname = "sliced";
+	tab[INDEX_MAX_KEYS+1].opttype = RELOPT_TYPE_BOOL;
+	tab[INDEX_MAX_KEYS+1].offset = offsetof(BloomOptions, sliced);
+
+	tab[INDEX_MAX_KEYS+2].optname = "fpr";
+	tab[INDEX_MAX_KEYS+2].opttype = RELOPT_TYPE_REAL;
+	tab[INDEX_MAX_KEYS+2].offset = offsetof(BloomOptions, fpr);
+
+	tab[INDEX_MAX_KEYS+3].optname = "nulls";
+	tab[INDEX_MAX_KEYS+3].opttype = RELOPT_TYPE_BOOL;
+	tab[INDEX_MAX_KEYS+3].offset = offsetof(BloomOptions, nulls);
+
 	options = parseRelOptions(reloptions, validate, bloom_kind, &numoptions);
 	rdopts = allocateReloptStruct(sizeof(BloomOptions), options, numoptions);
 	fillRelOptions((void *) rdopts, sizeof(BloomOptions), options, numoptions,
-						validate, tab, INDEX_MAX_KEYS+1);
+						validate, tab, INDEX_MAX_KEYS+4);
 		
 	rdopts = makeDefaultBloomOptions(rdopts);
 
+	if (validate && rdopts->sliced)
+	{
+		int32	sliceSize;
+
+		if (BloomSliceCapacity(rdopts->bloomLength, &sliceSize) == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("length %d is too large for bit-sliced bloom index",
+							rdopts->bloomLength)));
+	}
+
 	PG_RETURN_BYTEA_P(rdopts);
 }
@@ -1,40 +1,128 @@
 #include "postgres.h"
 
+#include <math.h>
+
 #include "access/genam.h"
+#include "catalog/pg_operator.h"
+#include "catalog/pg_type.h"
 #include "catalog/storage.h"
 #include "commands/vacuum.h"
 #include "miscadmin.h"
 #include "postmaster/autovacuum.h"
 #include "storage/bufmgr.h"
+#include "storage/freespace.h"
 #include "storage/indexfsm.h"
 #include "storage/lmgr.h"
+#include "utils/tuplesort.h"
 
 #include "bloom.h"
 
-PG_FUNCTION_INFO_V1(blbulkdelete);
-Datum       blbulkdelete(PG_FUNCTION_ARGS);
-Datum
-blbulkdelete(PG_FUNCTION_ARGS)
+/* compact index if this fraction of its pages could be freed */
+#define BLOOM_COMPACT_FREE_FRACTION	(0.1)
+/* pages of the tail compacted under AccessExclusiveLock by one vacuum */
+#define BLOOM_COMPACT_MAX_PAGES		(256)
+
+/*
+ * Collect numbers of tuples of page which are not dead into survivors,
+ * returns their number
+ */
+static int
+findSurvivors(BloomState *state, Page page, IndexBulkDeleteCallback callback,
+				void *callback_state, int *survivors)
+{
+	int			maxoff = BloomPageGetMaxOffset(page);
+	int			nSurvivors = 0;
+	int			i;
+
+	for(i=0; i<maxoff; i++)
+	{
+		ItemPointer	iptr;
+
+		if (BloomPageIsSliced(page))
+			iptr = BloomSliceGetHeapPtrs(page) + i;
+		else
+			iptr = &((BloomTuple*)(((char*)BloomPageGetData(page)) + 
+								   i * state->sizeOfBloomTuple))->heapPtr;
+
+		if (!callback(iptr, callback_state))
+			survivors[nSurvivors++] = i;
+	}
+
+	return nSurvivors;
+}
+
+/*
+ * Keep only survivors on page, shifting them down. Empty page becomes
+ * deleted. Should be called in critical section.
+ */
+static void
+removeDeadTuples(BloomState *state, Page page, int *survivors, int nSurvivors)
+{
+	int		maxoff = BloomPageGetMaxOffset(page);
+	int		j, nBit;
+
+	if (BloomPageIsSliced(page))
+	{
+		ItemPointerData	*heapPtrs = BloomSliceGetHeapPtrs(page);
+
+		for(j=0; j<nSurvivors; j++)
+			heapPtrs[j] = heapPtrs[survivors[j]];
+
+		for(nBit=0; nBit<state->opts->bloomLength * BITSIGNTYPE; nBit++)
+		{
+			BloomSliceWord	*slice = BloomSliceGetSlice(state, page, nBit);
+
+			/* survivors[j] >= j, so moving forward doesn't lose anything */
+			for(j=0; j<nSurvivors; j++)
+			{
+				if (SLICEGETBIT(slice, survivors[j]))
+					SLICESETBIT(slice, j);
+				else
+					SLICECLRBIT(slice, j);
+			}
+			for(; j<maxoff; j++)
+				SLICECLRBIT(slice, j);
+		}
+	}
+	else
+	{
+		char	*itup = (char*)BloomPageGetData(page);
+
+		for(j=0; j<nSurvivors; j++)
+			if (survivors[j] != j)
+				memcpy(itup + j * state->sizeOfBloomTuple,
+					   itup + survivors[j] * state->sizeOfBloomTuple,
+					   state->sizeOfBloomTuple);
+	}
+
+	BloomPageGetOpaque(page)->maxoff = nSurvivors;
+
+	if (nSurvivors == 0)
+		BloomPageSetDeleted(page);
+	else
+		BloomPageUpdateSummary(state, page);
+}
+
+/*
+ * Dead tuples are searched under share lock, callback is called for every
+ * tuple and it is the longest part. Only page with dead tuples is locked
+ * again with cleanup lock, which also waits for tuple at a time scans
+ * keeping matched heap pointers of the page. Inserts could add tuples to
+ * the page between the locks, they are alive.
+ */
+static void
+bulkDelete(Relation index, BloomState *state, BufferAccessStrategy strategy,
+			IndexBulkDeleteCallback callback, void *callback_state,
+			IndexBulkDeleteResult *stats)
 {
-	IndexVacuumInfo 		*info = (IndexVacuumInfo *) PG_GETARG_POINTER(0);
-	IndexBulkDeleteResult 	*stats = (IndexBulkDeleteResult *) PG_GETARG_POINTER(1);
-	IndexBulkDeleteCallback callback = (IndexBulkDeleteCallback) PG_GETARG_POINTER(2);
-	void       				*callback_state = (void *) PG_GETARG_POINTER(3);
-	Relation    			index = info->index;
 	BlockNumber             blkno,
+							prefetchBlkno = BLOOM_HEAD_BLKNO,
 							npages;
-	FreeBlockNumberArray	notFullPage;
-	int						countPage = 0;
-	BloomState				state;
 	bool					needLock;
-	Buffer					buffer;
-    Page            		page;
+	int						*survivors;
 
-
-	if (stats == NULL)
-		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
-
-	initBloomState(&state, index); 
+	/* bit-sliced page never keeps more tuples than common one */
+	survivors = palloc(sizeof(int) * (BLCKSZ / state->sizeOfBloomTuple + 1));
 
 	needLock = !RELATION_IS_LOCAL(index);
 
@@ -46,84 +134,454 @@ blbulkdelete(PG_FUNCTION_ARGS)
 
 	for(blkno=BLOOM_HEAD_BLKNO; blkno<npages; blkno++)
 	{
+		Buffer		buffer;
+		Page		page;
+		int			maxoff,
+					nSurvivors,
+					i;
+
+		vacuum_delay_point();
+
+		BloomPrefetch(index, &prefetchBlkno, blkno, npages);
 		buffer = ReadBufferExtended(index, MAIN_FORKNUM, blkno,
-									RBM_NORMAL, info->strategy);
+									RBM_NORMAL, strategy);
 
-        LockBuffer(buffer, BUFFER_LOCK_SHARE);
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
 		page = BufferGetPage(buffer);
 
-		if (!BloomPageIsDeleted(page))
+		if (PageIsNew(page) || BloomPageIsDeleted(page))
+		{
+			UnlockReleaseBuffer(buffer);
+			continue;
+		}
+
+		maxoff = BloomPageGetMaxOffset(page);
+		nSurvivors = findSurvivors(state, page, callback, callback_state, survivors);
+		LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
+
+		stats->tuples_removed += maxoff - nSurvivors;
+
+		if (nSurvivors < maxoff)
+		{
+			LockBufferForCleanup(buffer);
+
+			for(i=maxoff; i<BloomPageGetMaxOffset(page); i++)
+				survivors[nSurvivors++] = i;
+
+			START_CRIT_SECTION();
+			removeDeadTuples(state, page, survivors, nSurvivors);
+			MarkBufferDirty(buffer);
+			BloomLogPage(index, buffer);
+			END_CRIT_SECTION();
+
+			LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
+		}
+
+		stats->num_index_tuples += nSurvivors;
+		ReleaseBuffer(buffer);
+	}
+
+	pfree(survivors);
+}
+
+PG_FUNCTION_INFO_V1(blbulkdelete);
+Datum       blbulkdelete(PG_FUNCTION_ARGS);
+Datum
+blbulkdelete(PG_FUNCTION_ARGS)
+{
+	IndexVacuumInfo 		*info = (IndexVacuumInfo *) PG_GETARG_POINTER(0);
+	IndexBulkDeleteResult 	*stats = (IndexBulkDeleteResult *) PG_GETARG_POINTER(1);
+	IndexBulkDeleteCallback callback = (IndexBulkDeleteCallback) PG_GETARG_POINTER(2);
+	void       				*callback_state = (void *) PG_GETARG_POINTER(3);
+	BloomState				state;
+
+	if (stats == NULL)
+		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+
+	initBloomState(&state, info->index); 
+	bulkDelete(info->index, &state, info->strategy, callback, callback_state, stats);
+
+	/* free space of pages is recorded in FSM by blvacuumcleanup() */
+
+	PG_RETURN_POINTER(stats);
+}
+
+/*
+ * Copy i-th tuple of page into res of sizeOfBloomTuple bytes
+ */
+static void
+getPageTuple(BloomState *state, Page page, int i, BloomTuple *res)
+{
+	int		nBit;
+
+	if (!BloomPageIsSliced(page))
+	{
+		memcpy(res, ((char*)BloomPageGetData(page)) + i * state->sizeOfBloomTuple,
+			   state->sizeOfBloomTuple);
+		return;
+	}
+
+	memset(res, 0, state->sizeOfBloomTuple);
+	res->heapPtr = BloomSliceGetHeapPtrs(page)[i];
+	for(nBit=0; nBit<state->opts->bloomLength * BITSIGNTYPE; nBit++)
+		if (SLICEGETBIT(BloomSliceGetSlice(state, page, nBit), i))
+			SETBIT(res->sign, nBit);
+}
+
+/*
+ * Forget the last tuple of page, summary of common page should be updated
+ * by caller
+ */
+static void
+removeLastPageTuple(BloomState *state, Page page)
+{
+	int		last = --BloomPageGetOpaque(page)->maxoff;
+	int		nBit;
+
+	/* BloomPageAddItem() expects free slot to be clear */
+	if (BloomPageIsSliced(page))
+		for(nBit=0; nBit<state->opts->bloomLength * BITSIGNTYPE; nBit++)
+			SLICECLRBIT(BloomSliceGetSlice(state, page, nBit), last);
+}
+
+/*
+ * Record free space of the page which got moved tuples and release it
+ */
+static void
+releaseMoveTarget(Relation index, BloomState *state, Buffer buffer)
+{
+	Page	page = BufferGetPage(buffer);
+
+	if (!PageIsNew(page) && !BloomPageIsDeleted(page))
+		RecordPageWithFreeSpace(index, BufferGetBlockNumber(buffer),
+								BloomPageGetFsmSpace(state, page));
+
+	UnlockReleaseBuffer(buffer);
+}
+
+/*
+ * Move tuples from the last pages into free room of the first ones, so the
+ * emptied tail could be truncated. Caller holds AccessExclusiveLock on
+ * index: a scan reads pages in order and could miss a tuple moved from a
+ * page it hasn't read yet into a page already read. To keep the lock
+ * short, one call looks at most at BLOOM_COMPACT_MAX_PAGES pages of the
+ * tail and never sleeps in vacuum_delay_point(). Pages before *dstBlkno
+ * are known to be full, it's advanced for the next call. Returns number
+ * of emptied pages, free space of the rest of touched pages is recorded
+ * in FSM.
+ *
+ * Every move logs the page receiving tuples first and then the source
+ * page: crash between the two records could leave a tuple twice, but
+ * never lose it. So caller flags metapage BLOOM_COMPACTING before and
+ * clears it after, both logged. After crash the flag stays set, then
+ * blgettuple() skips heap pointers returned twice and the next vacuum
+ * removes duplicates, see removeDuplicates(). A bitmap scan merges
+ * duplicates anyway.
+ */
+static BlockNumber
+compactIndex(Relation index, BloomState *state, BlockNumber *dstBlkno,
+				BufferAccessStrategy strategy)
+{
+	BlockNumber			srcBlkno = RelationGetNumberOfBlocks(index) - 1,
+						nSrcPages = 0,
+						nEmptied = 0;
+	Buffer				dstBuffer = InvalidBuffer;
+	BloomTupleBuffer	tup;
+
+	while(srcBlkno > *dstBlkno && nSrcPages < BLOOM_COMPACT_MAX_PAGES)
+	{
+		Buffer	srcBuffer;
+		Page	srcPage;
+
+		srcBuffer = ReadBufferExtended(index, MAIN_FORKNUM, srcBlkno,
+									   RBM_NORMAL, strategy);
+		LockBuffer(srcBuffer, BUFFER_LOCK_EXCLUSIVE);
+		srcPage = BufferGetPage(srcBuffer);
+
+		while(!PageIsNew(srcPage) && !BloomPageIsDeleted(srcPage) &&
+				BloomPageGetMaxOffset(srcPage) > 0 && *dstBlkno < srcBlkno)
 		{
-        	BloomTuple	*itup = BloomPageGetData(page);
-			BloomTuple	*itupEnd = (BloomTuple*)( ((char*)itup) + 
-								 state.sizeOfBloomTuple * BloomPageGetMaxOffset(page));
-			BloomTuple	*itupPtr = itup;
+			Page	dstPage;
+			int		moved = 0;
 
-			while(itup < itupEnd)
+			if (!BufferIsValid(dstBuffer))
 			{
-				if (callback(&itup->heapPtr, callback_state))
-				{
-					stats->tuples_removed += 1;
-					START_CRIT_SECTION();
-					BloomPageGetOpaque(page)->maxoff--;
-					END_CRIT_SECTION();
-				} 
-				else 
+				dstBuffer = ReadBufferExtended(index, MAIN_FORKNUM, *dstBlkno,
+											   RBM_NORMAL, strategy);
+				LockBuffer(dstBuffer, BUFFER_LOCK_EXCLUSIVE);
+			}
+			dstPage = BufferGetPage(dstBuffer);
+
+			START_CRIT_SECTION();
+			if (!PageIsNew(dstPage) && !BloomPageIsDeleted(dstPage))
+			{
+				while(BloomPageGetMaxOffset(srcPage) > 0)
 				{
-					if ( itupPtr != itup )
-					{
-						START_CRIT_SECTION();
-						memcpy(itupPtr, itup, state.sizeOfBloomTuple);
-						END_CRIT_SECTION();
-					}
-					stats->num_index_tuples++;
-					itupPtr = (BloomTuple*)( ((char*)itupPtr) + state.sizeOfBloomTuple );
+					getPageTuple(state, srcPage, BloomPageGetMaxOffset(srcPage) - 1,
+								 &tup.tuple);
+					if (!BloomPageAddItem(state, dstPage, &tup.tuple))
+						break;
+					removeLastPageTuple(state, srcPage);
+					moved++;
 				}
-
-				itup = (BloomTuple*)( ((char*)itup) + state.sizeOfBloomTuple );
 			}
 
-			if (itupPtr != itup)
+			if (moved > 0)
 			{
-				if (itupPtr == BloomPageGetData(page))
+				if (BloomPageGetMaxOffset(srcPage) == 0)
 				{
-					START_CRIT_SECTION();
-					BloomPageSetDeleted(page);
-					END_CRIT_SECTION();
+					BloomPageSetDeleted(srcPage);
+					nEmptied++;
 				}
-				MarkBufferDirty(buffer);
+				else
+					BloomPageUpdateSummary(state, srcPage);
+				MarkBufferDirty(dstBuffer);
+				MarkBufferDirty(srcBuffer);
+				BloomLogPage(index, dstBuffer);
+				BloomLogPage(index, srcBuffer);
 			}
+			END_CRIT_SECTION();
 
-			if (!BloomPageIsDeleted(page) && 
-						BloomPageGetFreeSpace(&state, page) > state.sizeOfBloomTuple && 
-						countPage < BloomMetaBlockN)
-				notFullPage[countPage++] = blkno;
+			/* destination is full, go to the next one */
+			if (BloomPageGetMaxOffset(srcPage) > 0)
+			{
+				releaseMoveTarget(index, state, dstBuffer);
+				dstBuffer = InvalidBuffer;
+				(*dstBlkno)++;
+			}
 		}
 
-        UnlockReleaseBuffer(buffer);
-		CHECK_FOR_INTERRUPTS();
+		/* page met by destination keeps some tuples */
+		if (!PageIsNew(srcPage) && !BloomPageIsDeleted(srcPage))
+			RecordPageWithFreeSpace(index, srcBlkno,
+									BloomPageGetFsmSpace(state, srcPage));
+
+		UnlockReleaseBuffer(srcBuffer);
+		srcBlkno--;
+		nSrcPages++;
+	}
+
+	if (BufferIsValid(dstBuffer))
+		releaseMoveTarget(index, state, dstBuffer);
+
+	return nEmptied;
+}
+
+/*
+ * Set or clear BLOOM_COMPACTING flag of metapage
+ */
+static void
+setCompacting(Relation index, bool compacting)
+{
+	Buffer	buffer;
+	Page	page;
+
+	buffer = ReadBuffer(index, BLOOM_METAPAGE_BLKNO);
+	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+	page = BufferGetPage(buffer);
+
+	START_CRIT_SECTION();
+	if (compacting)
+		BloomPageSetCompacting(page);
+	else
+		BloomPageClearCompacting(page);
+	MarkBufferDirty(buffer);
+	BloomLogPage(index, buffer);
+	END_CRIT_SECTION();
+
+	UnlockReleaseBuffer(buffer);
+}
+
+typedef struct BloomDuplicate
+{
+	ItemPointerData	heapPtr;	/* hash key */
+	bool			seen;		/* first copy is met */
+} BloomDuplicate;
+
+/*
+ * Bulk delete callback: the first copy of duplicated heap pointer is kept,
+ * the rest are dead
+ */
+static bool
+isSeenDuplicate(ItemPointer itemPtr, void *state)
+{
+	BloomDuplicate	*dup;
+
+	dup = hash_search((HTAB *) state, itemPtr, HASH_FIND, NULL);
+	if (dup == NULL)
+		return false;
+	if (!dup->seen)
+	{
+		dup->seen = true;
+		return false;
 	}
+	return true;
+}
+
+/*
+ * Remove tuples left twice by crash in compactIndex(). Heap pointers of
+ * all tuples are sorted within maintenance_work_mem, ones met more than
+ * once are collected into hash, and then bulk delete keeps one copy of
+ * them. Inserts don't add heap pointers already indexed, so concurrent
+ * ones do no harm.
+ */
+static void
+removeDuplicates(Relation index, BloomState *state,
+					BufferAccessStrategy strategy)
+{
+	Tuplesortstate			*sort;
+	IndexBulkDeleteResult	dupStats;
+	HTAB					*dups = NULL;
+	BlockNumber				npages,
+							blkno,
+							prefetchBlkno = BLOOM_HEAD_BLKNO;
+	Datum					value;
+	bool					isnull;
+	int64					prev = -1;
+
+	sort = tuplesort_begin_datum(INT8OID, Int8LessOperator, InvalidOid, false,
+								 maintenance_work_mem, false);
 
-	if (countPage>0) 
+	npages = RelationGetNumberOfBlocks(index);
+	for(blkno=BLOOM_HEAD_BLKNO; blkno<npages; blkno++)
 	{
-		BloomMetaPageData	*metaData;
+		Buffer	buffer;
+		Page	page;
+		int		i;
 
-		buffer = ReadBuffer(index, BLOOM_METAPAGE_BLKNO);
-		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		vacuum_delay_point();
+
+		BloomPrefetch(index, &prefetchBlkno, blkno, npages);
+		buffer = ReadBufferExtended(index, MAIN_FORKNUM, blkno,
+									RBM_NORMAL, strategy);
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
 		page = BufferGetPage(buffer);
 
-		metaData = BloomPageGetMeta(page);
-		START_CRIT_SECTION();
-		memcpy(metaData->notFullPage, notFullPage, sizeof(FreeBlockNumberArray));
-		metaData->nStart=0;
-		metaData->nEnd = countPage;
-		END_CRIT_SECTION();
+		if (!PageIsNew(page) && !BloomPageIsDeleted(page))
+			for(i=0; i<BloomPageGetMaxOffset(page); i++)
+			{
+				ItemPointer	iptr;
+
+				if (BloomPageIsSliced(page))
+					iptr = BloomSliceGetHeapPtrs(page) + i;
+				else
+					iptr = &((BloomTuple*)(((char*)BloomPageGetData(page)) + 
+										   i * state->sizeOfBloomTuple))->heapPtr;
+
+				tuplesort_putdatum(sort,
+					Int64GetDatum(((int64) ItemPointerGetBlockNumber(iptr) << 16) |
+								  ItemPointerGetOffsetNumber(iptr)),
+					false);
+			}
 
-		MarkBufferDirty(buffer);
-        UnlockReleaseBuffer(buffer);
+		UnlockReleaseBuffer(buffer);
 	}
 
-	PG_RETURN_POINTER(stats);
+	tuplesort_performsort(sort);
+
+	while(tuplesort_getdatum(sort, true, &value, &isnull))
+	{
+		int64	cur = DatumGetInt64(value);
+
+		if (!FLOAT8PASSBYVAL)
+			pfree(DatumGetPointer(value));
+
+		if (cur == prev)
+		{
+			ItemPointerData	heapPtr;
+
+			if (dups == NULL)
+			{
+				HASHCTL		ctl;
+
+				memset(&ctl, 0, sizeof(ctl));
+				ctl.keysize = sizeof(ItemPointerData);
+				ctl.entrysize = sizeof(BloomDuplicate);
+				ctl.hash = tag_hash;
+				ctl.hcxt = CurrentMemoryContext;
+				dups = hash_create("Bloom duplicated heap pointers", 1024, &ctl,
+								   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+			}
+
+			ItemPointerSet(&heapPtr, (BlockNumber) (cur >> 16),
+						   (OffsetNumber) (cur & 0xFFFF));
+			((BloomDuplicate *) hash_search(dups, &heapPtr, HASH_ENTER, NULL))->seen = false;
+		}
+		prev = cur;
+	}
+
+	tuplesort_end(sort);
+
+	if (dups != NULL)
+	{
+		memset(&dupStats, 0, sizeof(dupStats));
+		bulkDelete(index, state, strategy, isSeenDuplicate, dups, &dupStats);
+		hash_destroy(dups);
+	}
+}
+
+/*
+ * Compaction is worth while at least BLOOM_COMPACT_FREE_FRACTION of data
+ * pages could be freed
+ */
+static bool
+worthCompacting(BloomState *state, BlockNumber npages, double nTuples)
+{
+	BlockNumber	dataPages;
+	double		neededPages;
+
+	if (npages <= BLOOM_HEAD_BLKNO + 1)
+		return false;
+
+	dataPages = npages - BLOOM_HEAD_BLKNO;
+	neededPages = ceil(nTuples / state->pageCapacity);
+
+	return dataPages - neededPages >= Max(dataPages * BLOOM_COMPACT_FREE_FRACTION, 1.0);
+}
+
+/*
+ * The last page which is not deleted, searched from lastBlock back
+ */
+static BlockNumber
+lastUsedBlock(Relation index, BlockNumber lastBlock, BufferAccessStrategy strategy)
+{
+	BlockNumber	blkno;
+
+	for(blkno = lastBlock; blkno > BLOOM_HEAD_BLKNO; blkno--)
+	{
+		Buffer	buffer;
+		bool	used;
+
+		buffer = ReadBufferExtended(index, MAIN_FORKNUM, blkno,
+									RBM_NORMAL, strategy);
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+		used = !BloomPageIsDeleted(BufferGetPage(buffer));
+		UnlockReleaseBuffer(buffer);
+
+		if (used)
+			break;
+	}
+
+	return blkno;
+}
+
+/*
+ * Truncate deleted pages at the end of index, returns number of removed
+ * pages. Caller holds AccessExclusiveLock. Inserts could reuse or add
+ * pages since they were seen, so the tail is checked again.
+ */
+static BlockNumber
+truncateTail(Relation index, BufferAccessStrategy strategy)
+{
+	BlockNumber	lastBlock = RelationGetNumberOfBlocks(index) - 1,
+				lastFilledBlock = lastUsedBlock(index, lastBlock, strategy);
+
+	if (lastBlock <= lastFilledBlock)
+		return 0;
+
+	RelationTruncate(index, lastFilledBlock + 1);
+
+	return lastBlock - lastFilledBlock;
 }
 
 PG_FUNCTION_INFO_V1(blvacuumcleanup);
@@ -137,9 +595,13 @@ blvacuumcleanup(PG_FUNCTION_ARGS)
 	bool        needLock;
 	BlockNumber npages,
 				blkno;
-	BlockNumber totFreePages;
-	BlockNumber lastBlock = BLOOM_HEAD_BLKNO,
-				lastFilledBlock = BLOOM_HEAD_BLKNO;
+	BlockNumber totFreePages,
+				removed,
+				emptied;
+	BlockNumber lastFilledBlock = BLOOM_HEAD_BLKNO,
+				dstBlkno = BLOOM_HEAD_BLKNO;
+	double		nTuples = 0;
+	BloomState	state;
 
 	if (info->analyze_only)
 		PG_RETURN_POINTER(stats);
@@ -147,6 +609,15 @@ blvacuumcleanup(PG_FUNCTION_ARGS)
 	if (stats == NULL)
 		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
 
+	initBloomState(&state, index);
+
+	/* the last compaction was interrupted by crash */
+	if (BloomIsCompacting(index))
+	{
+		removeDuplicates(index, &state, info->strategy);
+		setCompacting(index, false);
+	}
+
 	needLock = !RELATION_IS_LOCAL(index);
 
 	if (needLock)
@@ -155,6 +626,11 @@ blvacuumcleanup(PG_FUNCTION_ARGS)
 	if (needLock)
 		UnlockRelationForExtension(index, ExclusiveLock);
 
+	/*
+	 * Every page gets its free space in FSM: deleted pages are reused by
+	 * BloomNewBuffer() and inserts, not full ones by inserts only. Full
+	 * pages get zero, so stale entries are forgotten.
+	 */
 	totFreePages = 0;
 	for (blkno = BLOOM_HEAD_BLKNO; blkno < npages; blkno++)
 	{
@@ -175,24 +651,61 @@ blvacuumcleanup(PG_FUNCTION_ARGS)
 		}
 		else
 		{
+			RecordPageWithFreeSpace(index, blkno, BloomPageGetFsmSpace(&state, page));
 			lastFilledBlock = blkno;
-			stats->num_index_tuples += BloomPageGetMaxOffset(page);
-			stats->estimated_count += BloomPageGetMaxOffset(page);
+			nTuples += BloomPageGetMaxOffset(page);
 		}
 
 		UnlockReleaseBuffer(buffer);
 	}
 
-	lastBlock = npages - 1;
-	if (lastBlock > lastFilledBlock)
+	/*
+	 * Scans read every page, so if enough room is free it's worth to move
+	 * tuples and truncate the index, whether or not this vacuum deleted
+	 * anything. Tuples could be moved only if nobody uses the index, so
+	 * the lock is taken only if available at once, like lazy vacuum does
+	 * to truncate heap. It's released after every bounded step, so waiting
+	 * queries get in between, and the next step goes on only if the lock
+	 * is free again.
+	 */
+	while (worthCompacting(&state, npages, nTuples) &&
+		   ConditionalLockRelation(index, AccessExclusiveLock))
 	{
-		RelationTruncate(index, lastFilledBlock + 1);
-		stats->pages_removed = lastBlock - lastFilledBlock;
-		totFreePages = totFreePages - stats->pages_removed;
+		setCompacting(index, true);
+		emptied = compactIndex(index, &state, &dstBlkno, info->strategy);
+		setCompacting(index, false);
+		removed = truncateTail(index, info->strategy);
+		npages = RelationGetNumberOfBlocks(index);
+		UnlockRelation(index, AccessExclusiveLock);
+
+		stats->pages_removed += removed;
+		/* deleted pages counted above could be truncated too */
+		if (removed > emptied)
+			totFreePages -= Min(totFreePages, removed - emptied);
+
+		/* nothing was emptied, destination reached the tail */
+		if (removed == 0)
+			break;
+
+		vacuum_delay_point();
+	}
+
+	/* truncation breaks concurrent scans too */
+	if (npages - 1 > lastFilledBlock &&
+		ConditionalLockRelation(index, AccessExclusiveLock))
+	{
+		removed = truncateTail(index, info->strategy);
+		UnlockRelation(index, AccessExclusiveLock);
+
+		stats->pages_removed += removed;
+		totFreePages -= Min(totFreePages, removed);
 	}
 
 	IndexFreeSpaceMapVacuum(info->index);
 	stats->pages_free = totFreePages;
+	/* bulk delete counted survivors, but inserts could add more since */
+	stats->num_index_tuples = nTuples;
+	stats->estimated_count = false;
 
 	if (needLock)
 		LockRelationForExtension(index, ExclusiveLock);
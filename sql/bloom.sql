@@ -41,6 +41,207 @@ SELECT count(*) FROM tst WHERE i = 16;
 SELECT count(*) FROM tst WHERE t = '5';
 SELECT count(*) FROM tst WHERE i = 16 AND t = '5';
 
+DROP INDEX bloomidx;
+CREATE INDEX bloomidx ON tst USING bloom (i,t) WITH (col1=3, sliced=on);
+
+SELECT count(*) FROM tst WHERE i = 16;
+SELECT count(*) FROM tst WHERE t = '5';
+SELECT count(*) FROM tst WHERE i = 16 AND t = '5';
+
+DELETE FROM tst WHERE i > 500;
+VACUUM tst;
+
+SELECT count(*) FROM tst WHERE i = 16;
+SELECT count(*) FROM tst WHERE t = '5';
+SELECT count(*) FROM tst WHERE i = 16 AND t = '5';
+
+BEGIN;
+INSERT INTO tst SELECT i, t FROM tst WHERE i = 16;
+SELECT count(*) FROM tst WHERE i = 16;
+SAVEPOINT s;
+INSERT INTO tst SELECT i, t FROM tst WHERE i = 16;
+ROLLBACK TO s;
+SELECT count(*) FROM tst WHERE i = 16;
+COMMIT;
+
+CREATE TABLE tstx (i int4, t text);
+CREATE INDEX bloomidxx ON tstx USING bloom (i, t);
+
+BEGIN;
+DO $$
+BEGIN
+	INSERT INTO tstx SELECT i / 0, t FROM tst WHERE i = 16;
+EXCEPTION WHEN division_by_zero THEN
+	NULL;
+END $$;
+INSERT INTO tstx SELECT i, t FROM tst WHERE i = 16;
+SELECT count(*) FROM tstx WHERE i = 16;
+COMMIT;
+
+SELECT count(*) FROM tstx WHERE i = 16;
+
+DROP TABLE tstx;
+
+\copy tst from 'data/data'
+
+SELECT count(*) FROM tst WHERE i = 16;
+SELECT count(*) FROM tst WHERE i = 16 AND t = '5';
+
+CREATE UNLOGGED TABLE tstu AS SELECT * FROM tst;
+CREATE INDEX bloomidxu ON tstu USING bloom (i,t) WITH (col1=3);
+
+SELECT count(*) FROM tstu WHERE i = 16;
+SELECT count(*) FROM tstu WHERE i = 16 AND t = '5';
+
+INSERT INTO tstu SELECT * FROM tstu WHERE i = 16;
+
+SELECT count(*) FROM tstu WHERE i = 16;
+
+DROP TABLE tstu;
+
+DROP INDEX bloomidx;
+CREATE INDEX bloomidx ON tst USING bloom (i,t) WITH (fpr=0.01);
+
+SELECT count(*) FROM tst WHERE i = 16;
+SELECT count(*) FROM tst WHERE i = 16 AND t = '5';
+
+CREATE INDEX bloomidxfpr ON tst USING bloom (i,t) WITH (fpr=0.3);
+CREATE TEMP TABLE tstfpr AS SELECT pg_relation_size('bloomidxfpr') AS size;
+DROP INDEX bloomidxfpr;
+CREATE INDEX bloomidxfpr ON tst USING bloom (i,t) WITH (fpr=0.001);
+SELECT pg_relation_size('bloomidxfpr') > size FROM tstfpr;
+DROP INDEX bloomidxfpr;
+DROP TABLE tstfpr;
+
+SELECT count(*) FROM tst WHERE i IN (16, 17, NULL);
+SELECT count(*) FROM tst WHERE i IN (16, 17) AND t IN ('5', '6');
+
+SET enable_hashjoin=off;
+SET enable_mergejoin=off;
+
+SELECT count(*) FROM (VALUES (16), (17), (16)) v(x) JOIN tst ON tst.i = v.x;
+
+RESET enable_hashjoin;
+RESET enable_mergejoin;
+
+SET enable_bitmapscan=off;
+
+EXPLAIN (COSTS OFF) SELECT count(*) FROM tst WHERE i = 16;
+SELECT count(*) FROM tst WHERE i = 16;
+SELECT count(*) FROM tst WHERE i IN (16, 17) AND t IN ('5', '6');
+SELECT i, t FROM tst WHERE i = 16 AND t = '5' LIMIT 1;
+
+SET enable_bitmapscan=on;
+
+CREATE TABLE tstt AS
+	SELECT i::int2 AS i2, i::int8 AS i8, i::float8 AS f8, t::numeric AS n,
+		t::bytea AS b, (i > 500) AS bo, '2000-01-01'::date + i AS d,
+		md5(i::text)::uuid AS u
+	FROM tst;
+CREATE INDEX bloomidxt ON tstt USING bloom (i2, i8, f8, n, b, bo, d, u);
+
+SELECT count(*) FROM tstt WHERE i8 = 16;
+SELECT count(*) FROM tstt WHERE i2 = 16 AND n = 5;
+SELECT count(*) FROM tstt WHERE f8 = 16 AND b = '5';
+SELECT count(*) FROM tstt WHERE d = '2000-01-17';
+SELECT count(*) FROM tstt WHERE bo AND i8 = 600;
+SELECT count(*) FROM tstt WHERE u = md5('16')::uuid;
+
+DROP TABLE tstt;
+
+CREATE TABLE tsta AS
+	SELECT ARRAY[i, i % 10] AS ia, ARRAY[t, 'x' || i] AS ta FROM tst;
+CREATE INDEX bloomidxa ON tsta USING bloom (ia, ta);
+
+SELECT count(*) FROM tsta WHERE ia @> ARRAY[16];
+SELECT count(*) FROM tsta WHERE ia @> ARRAY[16, 6];
+SELECT count(*) FROM tsta WHERE ia = ARRAY[16, 6];
+SELECT count(*) FROM tsta WHERE ia && ARRAY[16, 17];
+SELECT count(*) FROM tsta WHERE ia && '{NULL}'::int4[];
+SELECT count(*) FROM tsta WHERE ia @> ARRAY[16] AND ta @> ARRAY['5'];
+SELECT count(*) FROM tsta WHERE ta && ARRAY['x600', NULL];
+
+SET enable_bitmapscan=off;
+
+EXPLAIN (COSTS OFF) SELECT count(*) FROM tsta WHERE ia @> ARRAY[16];
+SELECT count(*) FROM tsta WHERE ia @> ARRAY[16];
+EXPLAIN (COSTS OFF) SELECT count(*) FROM tsta WHERE ia && ARRAY[16, 17];
+SELECT count(*) FROM tsta WHERE ia && ARRAY[16, 17];
+
+SET enable_bitmapscan=on;
+
+DROP TABLE tsta;
+
+CREATE TABLE tstn AS
+	SELECT CASE WHEN i % 3 = 0 THEN NULL ELSE i END AS a,
+		CASE WHEN i % 5 = 0 THEN NULL ELSE t END AS b
+	FROM tst;
+CREATE INDEX bloomidxn ON tstn USING bloom (a, b) WITH (nulls=on);
+
+SELECT count(*) FROM tstn WHERE a IS NULL AND b = '5';
+SELECT count(*) FROM tstn WHERE a = 20 AND b IS NULL;
+SELECT count(*) FROM tstn WHERE a IS NULL AND b IS NULL;
+SELECT count(*) FROM tstn WHERE a IS NOT NULL AND b = '5';
+
+SET enable_bitmapscan=off;
+
+EXPLAIN (COSTS OFF) SELECT count(*) FROM tstn WHERE a IS NULL AND b = '5';
+SELECT count(*) FROM tstn WHERE a IS NULL AND b = '5';
+
+SET enable_bitmapscan=on;
+
+DROP TABLE tstn;
+
+SELECT count(*) FROM tst WHERE i IS NULL;
+
+CREATE TABLE tstf AS SELECT * FROM tst;
+CREATE INDEX bloomidxf ON tstf USING bloom (i, t);
+CREATE TEMP TABLE tstfsize AS SELECT pg_relation_size('bloomidxf') AS size;
+DELETE FROM tstf WHERE i % 2 = 0;
+VACUUM tstf;
+
+SELECT pg_relation_size('bloomidxf') < size FROM tstfsize;
+SELECT count(*) FROM tstf WHERE i = 17;
+
+SET enable_bitmapscan=off;
+
+EXPLAIN (COSTS OFF) SELECT count(*) FROM tstf WHERE i = 17;
+SELECT count(*) FROM tstf WHERE i = 17;
+SELECT count(*) FROM tstf WHERE i = 16;
+
+SET enable_bitmapscan=on;
+
+INSERT INTO tstf SELECT * FROM tst WHERE i % 2 = 0;
+
+SELECT pg_relation_size('bloomidxf') <= size FROM tstfsize;
+SELECT count(*) FROM tstf WHERE i = 16;
+
+DELETE FROM tstf;
+VACUUM tstf;
+
+SELECT pg_relation_size('bloomidxf') = 2 * current_setting('block_size')::int;
+
+INSERT INTO tstf SELECT * FROM tst WHERE i = 16;
+
+SELECT count(*) FROM tstf WHERE i = 16;
+
+DROP TABLE tstf;
+DROP TABLE tstfsize;
+
+CREATE TABLE tstm AS SELECT i FROM generate_series(1, 2000) i;
+CREATE INDEX bloomidxm ON tstm USING bloom (i);
+
+SELECT count(*) FROM generate_series(1, 2000) g
+	WHERE EXISTS (SELECT 1 FROM tstm WHERE i = g);
+
+DROP INDEX bloomidxm;
+CREATE INDEX bloomidxm ON tstm USING bloom (i) WITH (length=13);
+
+SELECT count(*) FROM generate_series(1, 2000) g
+	WHERE EXISTS (SELECT 1 FROM tstm WHERE i = g);
+
+DROP TABLE tstm;
+
 RESET enable_seqscan;
 RESET enable_bitmapscan;
 RESET enable_indexscan;
@@ -1,5 +1,22 @@
 DROP OPERATOR CLASS IF EXISTS int4_ops USING bloom CASCADE; 
 DROP OPERATOR CLASS IF EXISTS text_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS int2_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS int8_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS float4_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS float8_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS uuid_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS bytea_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS date_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS timestamp_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS timestamptz_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS numeric_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS inet_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS bool_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS _int2_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS _int4_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS _int8_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS _text_ops USING bloom CASCADE; 
+DROP OPERATOR CLASS IF EXISTS _uuid_ops USING bloom CASCADE; 
 
 DELETE FROM pg_am WHERE amname='bloom';
 
@@ -11,6 +28,7 @@ DROP FUNCTION IF EXISTS blrescan(internal) CASCADE;
 DROP FUNCTION IF EXISTS blendscan(internal) CASCADE;
 DROP FUNCTION IF EXISTS blmarkpos(internal) CASCADE;
 DROP FUNCTION IF EXISTS blrestrpos(internal) CASCADE;
+DROP FUNCTION IF EXISTS blgettuple(internal) CASCADE;
 DROP FUNCTION IF EXISTS blgetbitmap(internal) CASCADE;
 DROP FUNCTION IF EXISTS blbulkdelete(internal) CASCADE;
 DROP FUNCTION IF EXISTS blvacuumcleanup(internal) CASCADE;